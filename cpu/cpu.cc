@@ -75,11 +75,15 @@ void BX_CPU_C::cpu_loop(void)
 
     bxICacheEntry_c *entry = getICacheEntry();
     bxInstruction_c *i = entry->i;
+    BX_ENTER_TRACE(entry);
 
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
     for(;;) {
+      BX_COUNT_INSTRUCTION();
       // want to allow changing of the instruction inside instrumentation callback
-      BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+      if (BX_TRACE_INSTRUMENTED) {
+        BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+      }
       RIP += i->ilen();
       // when handlers chaining is enabled this single call will execute entire trace
       BX_CPU_CALL_METHOD(i->execute1, (i)); // might iterate repeat instruction
@@ -88,7 +92,9 @@ void BX_CPU_C::cpu_loop(void)
 
       if (BX_CPU_THIS_PTR async_event) break;
 
-      i = getICacheEntry()->i;
+      entry = getICacheEntry();
+      i = entry->i;
+      BX_ENTER_TRACE(entry);
     }
 #else // BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS == 0
 
@@ -101,12 +107,17 @@ void BX_CPU_C::cpu_loop(void)
         debug_disasm_instruction(BX_CPU_THIS_PTR prev_rip);
 #endif
 
+      BX_COUNT_INSTRUCTION();
       // want to allow changing of the instruction inside instrumentation callback
-      BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+      if (BX_TRACE_INSTRUMENTED) {
+        BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+      }
       RIP += i->ilen();
       BX_CPU_CALL_METHOD(i->execute1, (i)); // might iterate repeat instruction
       BX_CPU_THIS_PTR prev_rip = RIP; // commit new RIP
-      BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, i);
+      if (BX_TRACE_INSTRUMENTED) {
+        BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, i);
+      }
       BX_CPU_THIS_PTR icount++;
 
       BX_SYNC_TIME_IF_SINGLE_PROCESSOR(0);
@@ -122,6 +133,7 @@ void BX_CPU_C::cpu_loop(void)
         entry = getICacheEntry();
         i = entry->i;
         last = i + (entry->tlen);
+        BX_ENTER_TRACE(entry);
       }
     }
 #endif
@@ -147,10 +159,14 @@ void BX_CPU_C::cpu_run_trace(void)
 
   bxICacheEntry_c *entry = getICacheEntry();
   bxInstruction_c *i = entry->i;
+  BX_ENTER_TRACE(entry);
 
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
+  BX_COUNT_INSTRUCTION();
   // want to allow changing of the instruction inside instrumentation callback
-  BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+  if (BX_TRACE_INSTRUMENTED) {
+    BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+  }
   RIP += i->ilen();
   // when handlers chaining is enabled this single call will execute entire trace
   BX_CPU_CALL_METHOD(i->execute1, (i)); // might iterate repeat instruction
@@ -163,12 +179,17 @@ void BX_CPU_C::cpu_run_trace(void)
   bxInstruction_c *last = i + (entry->tlen);
 
   for(;;) {
+    BX_COUNT_INSTRUCTION();
     // want to allow changing of the instruction inside instrumentation callback
-    BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+    if (BX_TRACE_INSTRUMENTED) {
+      BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, i);
+    }
     RIP += i->ilen();
     BX_CPU_CALL_METHOD(i->execute1, (i)); // might iterate repeat instruction
     BX_CPU_THIS_PTR prev_rip = RIP; // commit new RIP
-    BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, i);
+    if (BX_TRACE_INSTRUMENTED) {
+      BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, i);
+    }
     BX_CPU_THIS_PTR icount++;
 
     if (BX_CPU_THIS_PTR async_event) {
@@ -252,8 +273,23 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::linkTrace(bxInstruction_c *i)
 
   bxInstruction_c *next = i->getNextTrace(BX_CPU_THIS_PTR iCache.traceLinkTimeStamp);
   if (next) {
+#if BX_INSTRUMENTATION
+    // the link only knows the first instruction of the trace, find back its
+    // icache entry for the trace enter callback and fall back to the lookup
+    // if it has gone
+    bx_address eipBiased = RIP + BX_CPU_THIS_PTR eipPageBias;
+    if (eipBiased < BX_CPU_THIS_PTR eipPageWindowSize) {
+      bx_phy_address pAddr = BX_CPU_THIS_PTR pAddrFetchPage + eipBiased;
+      bxICacheEntry_c *entry = BX_CPU_THIS_PTR iCache.get_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
+      if (entry->pAddr == pAddr && entry->i == next) {
+        BX_ENTER_TRACE(entry);
+        BX_EXECUTE_INSTRUCTION(next);
+      }
+    }
+#else
     BX_EXECUTE_INSTRUCTION(next);
     return;
+#endif
   }
 
   bx_address eipBiased = RIP + BX_CPU_THIS_PTR eipPageBias;
@@ -271,6 +307,7 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::linkTrace(bxInstruction_c *i)
   {
     i->setNextTrace(entry->i, BX_CPU_THIS_PTR iCache.traceLinkTimeStamp);
     i = entry->i;
+    BX_ENTER_TRACE(entry);
     BX_EXECUTE_INSTRUCTION(i);
   }
 }
@@ -296,7 +333,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat(bxInstruction_c *i, BxRepIterationP
     while(1) {
       if (RCX != 0) {
         BX_CPU_CALL_REP_ITERATION(execute, (i));
-        BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        if (BX_TRACE_INSTRUMENTED) {
+          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        }
         RCX --;
       }
       if (RCX == 0) return;
@@ -317,7 +356,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat(bxInstruction_c *i, BxRepIterationP
     while(1) {
       if (ECX != 0) {
         BX_CPU_CALL_REP_ITERATION(execute, (i));
-        BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        if (BX_TRACE_INSTRUMENTED) {
+          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        }
         RCX = ECX - 1;
       }
       if (ECX == 0) return;
@@ -337,7 +378,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat(bxInstruction_c *i, BxRepIterationP
     while(1) {
       if (CX != 0) {
         BX_CPU_CALL_REP_ITERATION(execute, (i));
-        BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        if (BX_TRACE_INSTRUMENTED) {
+          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+        }
         CX --;
       }
       if (CX == 0) return;
@@ -358,6 +401,7 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat(bxInstruction_c *i, BxRepIterationP
 #endif
 
   RIP = BX_CPU_THIS_PTR prev_rip; // repeat loop not done, restore RIP
+  BX_SUSPEND_REPEAT();
 
   // assert magic async_event to stop trace execution
   BX_CPU_THIS_PTR async_event |= BX_ASYNC_EVENT_STOP_TRACE;
@@ -383,7 +427,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (RCX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           RCX --;
         }
         if (! get_ZF() || RCX == 0) return;
@@ -404,7 +450,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (ECX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           RCX = ECX - 1;
         }
         if (! get_ZF() || ECX == 0) return;
@@ -424,7 +472,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (CX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           CX --;
         }
         if (! get_ZF() || CX == 0) return;
@@ -446,7 +496,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (RCX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           RCX --;
         }
         if (get_ZF() || RCX == 0) return;
@@ -467,7 +519,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (ECX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           RCX = ECX - 1;
         }
         if (get_ZF() || ECX == 0) return;
@@ -487,7 +541,9 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
       while(1) {
         if (CX != 0) {
           BX_CPU_CALL_REP_ITERATION(execute, (i));
-          BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          if (BX_TRACE_INSTRUMENTED) {
+            BX_INSTR_REPEAT_ITERATION(BX_CPU_ID, i);
+          }
           CX --;
         }
         if (get_ZF() || CX == 0) return;
@@ -509,6 +565,7 @@ void BX_CPP_AttrRegparmN(2) BX_CPU_C::repeat_ZF(bxInstruction_c *i, BxRepIterati
 #endif
 
   RIP = BX_CPU_THIS_PTR prev_rip; // repeat loop not done, restore RIP
+  BX_SUSPEND_REPEAT();
 
   // assert magic async_event to stop trace execution
   BX_CPU_THIS_PTR async_event |= BX_ASYNC_EVENT_STOP_TRACE;
@@ -1190,8 +1190,64 @@ public: // for now...
   BX_CPU_THIS_PTR far_branch.prev_rip = PREV_RIP; \
 }
 
+  // copy of the instrumented flag of the trace being executed, the
+  // execution callbacks are skipped for the traces the instrumentation
+  // doesn't want to see
+  bx_bool trace_instrumented;
+
+// the trace of the icache entry 'entry' is entered
+#define BX_ENTER_TRACE(entry) do { \
+  BX_CPU_THIS_PTR trace_instrumented = (entry)->instrumented; \
+  BX_INSTR_TRACE_ENTER(BX_CPU_ID, BX_CPU_THIS_PTR get_laddr(BX_SEG_REG_CS, RIP), \
+    (entry)->pAddr, (entry)->ninstr, (entry)->ilen); \
+} while (0)
+#define BX_TRACE_INSTRUMENTED (BX_CPU_THIS_PTR trace_instrumented)
+
+  // architectural instruction count for the instrumentation: one per
+  // instruction started, a REP instruction counted once even when its
+  // iterations are suspended by async events, and one per interrupt
+  // delivered. Before counting an instruction or an interrupt,
+  // BX_INSTR_ICOUNT_BOUNDARY is called, then BX_INSTR_ICOUNT_TARGET once
+  // if the count is already at icount_target (0 for none)
+  Bit64u arch_icount;
+  Bit64u icount_target;
+  // the REP instruction at rep_suspended_rip isn't counted again if it is
+  // the next instruction to start
+  bx_bool rep_suspended;
+  bx_address rep_suspended_rip;
+
+#define BX_ICOUNT_INC() do { \
+  BX_INSTR_ICOUNT_BOUNDARY(BX_CPU_ID); \
+  if (BX_CPU_THIS_PTR icount_target != 0 && \
+      BX_CPU_THIS_PTR arch_icount >= BX_CPU_THIS_PTR icount_target) { \
+    BX_CPU_THIS_PTR icount_target = 0; \
+    BX_INSTR_ICOUNT_TARGET(BX_CPU_ID, BX_CPU_THIS_PTR arch_icount); \
+  } \
+  BX_CPU_THIS_PTR arch_icount++; \
+} while (0)
+
+#define BX_COUNT_INSTRUCTION() do { \
+  if (! BX_CPU_THIS_PTR rep_suspended || \
+      BX_CPU_THIS_PTR prev_rip != BX_CPU_THIS_PTR rep_suspended_rip) \
+    BX_ICOUNT_INC(); \
+  BX_CPU_THIS_PTR rep_suspended = 0; \
+} while (0)
+#define BX_COUNT_INTERRUPT() do { \
+  BX_CPU_THIS_PTR rep_suspended = 0; \
+  BX_ICOUNT_INC(); \
+} while (0)
+#define BX_SUSPEND_REPEAT() do { \
+  BX_CPU_THIS_PTR rep_suspended = 1; \
+  BX_CPU_THIS_PTR rep_suspended_rip = BX_CPU_THIS_PTR prev_rip; \
+} while (0)
+
 #else
 #define BX_INSTR_FAR_BRANCH_ORIGIN()
+#define BX_ENTER_TRACE(entry)
+#define BX_TRACE_INSTRUMENTED 0
+#define BX_COUNT_INSTRUCTION()
+#define BX_COUNT_INTERRUPT()
+#define BX_SUSPEND_REPEAT()
 #endif
 
 #define BX_DTLB_SIZE 2048
@@ -4274,7 +4330,6 @@ public: // for now...
 
 #if BX_DEBUGGER
   BX_SMF void       dbg_take_dma(void);
-  BX_SMF bx_bool    dbg_set_eflags(Bit32u val);
   BX_SMF void       dbg_set_eip(bx_address val);
   BX_SMF bx_bool    dbg_get_sreg(bx_dbg_sreg_t *sreg, unsigned sreg_no);
   BX_SMF bx_bool    dbg_set_sreg(unsigned sreg_no, bx_segment_reg_t *sreg);
@@ -4286,6 +4341,9 @@ public: // for now...
 #endif
 #if BX_DEBUGGER || BX_GDBSTUB
   BX_SMF bx_bool  dbg_instruction_epilog(void);
+#endif
+#if BX_DEBUGGER || BX_INSTRUMENTATION
+  BX_SMF bx_bool  dbg_set_eflags(Bit32u val);
 #endif
   BX_SMF bx_bool  dbg_xlate_linear2phy(bx_address linear, bx_phy_address *phy, bx_address *lpf_mask = 0, bx_bool verbose = 0);
 #if BX_SUPPORT_VMX >= 2
@@ -4773,6 +4831,18 @@ public: // for now...
   BX_SMF BX_CPP_INLINE Bit64u get_icount(void) { return BX_CPU_THIS_PTR icount; }
   BX_SMF BX_CPP_INLINE void sync_icount(void) { BX_CPU_THIS_PTR icount_last_sync = BX_CPU_THIS_PTR icount; }
   BX_SMF BX_CPP_INLINE Bit64u get_icount_last_sync(void) { return BX_CPU_THIS_PTR icount_last_sync; }
+#if BX_INSTRUMENTATION
+  BX_SMF BX_CPP_INLINE Bit64u get_arch_icount(void) { return BX_CPU_THIS_PTR arch_icount; }
+  BX_SMF BX_CPP_INLINE void set_arch_icount(Bit64u icount) {
+    BX_CPU_THIS_PTR arch_icount = icount;
+    BX_CPU_THIS_PTR rep_suspended = 0;
+  }
+  BX_SMF BX_CPP_INLINE void set_icount_target(Bit64u target) { BX_CPU_THIS_PTR icount_target = target; }
+  // from BX_INSTR_TRACE_ENTER: override the instrumented flag of the trace
+  // for this execution of it only
+  BX_SMF BX_CPP_INLINE bx_bool get_trace_instrumented(void) { return BX_CPU_THIS_PTR trace_instrumented; }
+  BX_SMF BX_CPP_INLINE void set_trace_instrumented(bx_bool instrumented) { BX_CPU_THIS_PTR trace_instrumented = instrumented; }
+#endif
 
   BX_SMF BX_CPP_INLINE bx_address get_instruction_pointer(void);
 
@@ -5640,12 +5710,21 @@ class bxInstruction_c;
 
 #define BX_COMMIT_INSTRUCTION(i) {                     \
   BX_CPU_THIS_PTR prev_rip = RIP; /* commit new RIP */ \
-  BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, (i));            \
+  if (BX_TRACE_INSTRUMENTED) {                         \
+    BX_INSTR_AFTER_EXECUTION(BX_CPU_ID, (i));          \
+  }                                                    \
   BX_CPU_THIS_PTR icount++;                            \
 }
 
+// the inserted end of trace opcode is not a guest instruction, it is
+// never reported to the instrumentation
 #define BX_EXECUTE_INSTRUCTION(i) {                    \
-  BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, (i));           \
+  if (BX_INSTRUMENTATION && (i)->execute1 != &BX_CPU_C::BxEndTrace) { \
+    BX_COUNT_INSTRUCTION();                            \
+    if (BX_TRACE_INSTRUMENTED) {                       \
+      BX_INSTR_BEFORE_EXECUTION(BX_CPU_ID, (i));       \
+    }                                                  \
+  }                                                    \
   RIP += (i)->ilen();                                  \
   return BX_CPU_CALL_METHOD(i->execute1, (i));         \
 }
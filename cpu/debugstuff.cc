@@ -258,7 +258,9 @@ void BX_CPU_C::dbg_set_eip(bx_address val)
   RIP = BX_CPU_THIS_PTR prev_rip = val;
   invalidate_prefetch_q();
 }
+#endif  // #if BX_DEBUGGER
 
+#if BX_DEBUGGER || BX_INSTRUMENTATION
 bx_bool BX_CPU_C::dbg_set_eflags(Bit32u val)
 {
   // returns 1=OK, 0=can't change
@@ -287,7 +289,9 @@ bx_bool BX_CPU_C::dbg_set_eflags(Bit32u val)
   BX_CPU_THIS_PTR set_OF(val & 0x01);
   return(1);
 }
+#endif
 
+#if BX_DEBUGGER
 unsigned BX_CPU_C::dbg_query_pending(void)
 {
   unsigned ret = 0;
@@ -765,6 +765,7 @@ void BX_CPU_C::interrupt(Bit8u vector, unsigned type, bx_bool push_error, Bit16u
   bx_dbg_interrupt(BX_CPU_ID, vector, error_code);
 #endif
 
+  BX_COUNT_INTERRUPT();
   BX_INSTR_INTERRUPT(BX_CPU_ID, vector);
 
   invalidate_prefetch_q();
@@ -75,6 +75,27 @@ void genDummyICacheEntry(bxInstruction_c *i)
 
 #endif
 
+#if BX_INSTRUMENTATION
+static Bit32u traceByteLength(const bxInstruction_c *i, unsigned len)
+{
+  Bit32u ilen = 0;
+  for (unsigned n=0; n < len; n++)
+    ilen += i[n].ilen();
+  return ilen;
+}
+
+// ask the instrumentation whether the execution callbacks of the new trace
+// (of 'len' guest instructions) are wanted, and remember its extent for
+// the trace enter callback
+#define BX_INSTRUMENT_TRACE(entry, len) do { \
+  (entry)->instrumented = BX_INSTR_TRACE_INSTRUMENTED(BX_CPU_ID, (entry)->pAddr, (entry)->i, (len)); \
+  (entry)->ninstr = (len); \
+  (entry)->ilen = traceByteLength((entry)->i, (len)); \
+} while (0)
+#else
+#define BX_INSTRUMENT_TRACE(entry, len)
+#endif
+
 bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAddr)
 {
   bxICacheEntry_c *entry = BX_CPU_THIS_PTR iCache.get_entry(pAddr, BX_CPU_THIS_PTR fetchModeMask);
@@ -136,6 +157,8 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
       pageWriteStampTable.markICacheMask(entry->pAddr, entry->traceMask);
       pageWriteStampTable.markICacheMask(BX_CPU_THIS_PTR pAddrFetchPage, 0x1);
 
+      BX_INSTRUMENT_TRACE(entry, entry->tlen);
+
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
       entry->tlen++; /* Add the inserted end of trace opcode */
       genDummyICacheEntry(++i);
@@ -174,6 +197,12 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
       if (mergeTraces(entry, i, pAddr)) {
           entry->traceMask |= traceMask;
           pageWriteStampTable.markICacheMask(pAddr, entry->traceMask);
+#if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
+          // the merged trace brought its end of trace opcode
+          BX_INSTRUMENT_TRACE(entry, entry->tlen - 1);
+#else
+          BX_INSTRUMENT_TRACE(entry, entry->tlen);
+#endif
           BX_CPU_THIS_PTR iCache.commit_trace(entry->tlen);
           return entry;
       }
@@ -186,6 +215,8 @@ bxICacheEntry_c* BX_CPU_C::serveICacheMiss(Bit32u eipBiased, bx_phy_address pAdd
 
   pageWriteStampTable.markICacheMask(pAddr, entry->traceMask);
 
+  BX_INSTRUMENT_TRACE(entry, entry->tlen);
+
 #if BX_SUPPORT_HANDLERS_CHAINING_SPEEDUPS
   entry->tlen++; /* Add the inserted end of trace opcode */
   genDummyICacheEntry(i);
@@ -111,6 +111,12 @@ struct bxICacheEntry_c
 
   Bit32u tlen;          // Trace length in instructions
   bxInstruction_c *i;
+
+#if BX_INSTRUMENTATION
+  bx_bool instrumented; // Execution callbacks wanted for this trace
+  Bit16u ninstr;        // Guest instructions in the trace
+  Bit16u ilen;          // Guest code bytes covered by the trace
+#endif
 };
 
 #define BX_MAX_TRACE_LENGTH 32
@@ -703,8 +703,15 @@ void BX_CPU_C::reset(unsigned source)
   memset(&BX_CPU_THIS_PTR oszapc, 0, sizeof(BX_CPU_THIS_PTR oszapc));
   clearEFlagsOSZAPC();	        // update lazy flags state
 
-  if (source == BX_RESET_HARDWARE)
+  if (source == BX_RESET_HARDWARE) {
     BX_CPU_THIS_PTR icount = 0;
+#if BX_INSTRUMENTATION
+    BX_CPU_THIS_PTR arch_icount = 0;
+    BX_CPU_THIS_PTR icount_target = 0;
+    BX_CPU_THIS_PTR rep_suspended = 0;
+    BX_CPU_THIS_PTR rep_suspended_rip = 0;
+#endif
+  }
   BX_CPU_THIS_PTR icount_last_sync = BX_CPU_THIS_PTR icount;
 
   BX_CPU_THIS_PTR inhibit_mask = 0;
@@ -328,7 +328,7 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::INSW32_YwDX(bxInstruction_c *i)
   /* If conditions are right, we can transfer IO to physical memory
    * in a batch, rather than one instruction at a time.
    */
-  if (i->repUsedL() && !BX_CPU_THIS_PTR async_event)
+  if (i->repUsedL() && !BX_CPU_THIS_PTR async_event && !BX_TRACE_INSTRUMENTED)
   {
     Bit32u wordCount = ECX;
     BX_ASSERT(wordCount > 0);
@@ -579,7 +579,7 @@ void BX_CPP_AttrRegparmN(1) BX_CPU_C::OUTSW32_DXXw(bxInstruction_c *i)
   /* If conditions are right, we can transfer IO to physical memory
    * in a batch, rather than one instruction at a time.
    */
-  if (i->repUsedL() && !BX_CPU_THIS_PTR async_event) {
+  if (i->repUsedL() && !BX_CPU_THIS_PTR async_event && !BX_TRACE_INSTRUMENTED) {
     Bit32u wordCount = ECX;
     wordCount = FastRepOUTSW(i->seg(), esi, DX, wordCount);
     if (wordCount) {
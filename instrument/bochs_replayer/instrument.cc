@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <experimental/optional>
+#include <vector>
 
 #include "tetrane/bochs_replayer/replayer/replayer.h"
 #include "tetrane/bochs_replayer/tracer/tracer.h"
@@ -6,59 +8,113 @@
 #include "tetrane/bochs_replayer/icount/icount.h"
 #include "tetrane/bochs_replayer/icount/fns.h"
 #include "tetrane/bochs_replayer/util/log.h"
+#include "tetrane/bochs_replayer/util/telemetry.h"
 
 extern reven::replayer::Replayer replayer;
 extern std::experimental::optional<reven::tracer::Tracer> tracer;
 extern std::experimental::optional<reven::memhist_tracer::MemhistTracer> memhist_tracer;
 extern reven::icount::ICount tick_counter;
 
+using reven::util::telemetry;
+
+// Everything is delivered until the outputs are known
+Bit32u bx_instr_subscriptions = ~0u;
+
+bx_instr_access_log_t *bx_instr_access_logs = NULL;
+
 namespace {
 	std::experimental::optional<std::uint64_t> rip_repeat_iteration;
 
-	class {
-	public:
-		void clear() {
-			lin1_ = 0;
-			lin2_ = 0;
+	// Events needed for the whole replay, set once the outputs are known
+	Bit32u base_subscriptions = ~0u;
 
-			phys1_ = 0;
-			phys2_ = 0;
+	Bit32u output_subscriptions() {
+		// A read/write from a device is always a desync
+		Bit32u events = BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(BX_RW);
+
+		if (tracer) {
+			// Only the writes are traced, the RMW reads are needed to match their physical write
+			events |= BX_INSTR_SUBSCRIBE_LIN_ACCESS(BX_WRITE) | BX_INSTR_SUBSCRIBE_LIN_ACCESS(BX_RW)
+			        | BX_INSTR_SUBSCRIBE_PHY_ACCESS(BX_WRITE) | BX_INSTR_SUBSCRIBE_PHY_ACCESS(BX_RW)
+			        | BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(BX_WRITE)
+			        | BX_INSTR_SUBSCRIBE_TLB_CNTRL | BX_INSTR_SUBSCRIBE_WRMSR;
 		}
 
-		bool register_new_access(bx_address lin, bx_phy_address phys) {
-			if (lin1_ == 0) {
-				lin1_ = lin;
-				phys1_ = phys;
-			} else if (lin2_ == 0) {
-				lin2_ = lin;
-				phys2_ = phys;
-			} else {
-				return false;
+		if (memhist_tracer) {
+			for (unsigned rw : {BX_READ, BX_WRITE, BX_EXECUTE, BX_RW}) {
+				events |= BX_INSTR_SUBSCRIBE_LIN_ACCESS(rw) | BX_INSTR_SUBSCRIBE_PHY_ACCESS(rw);
 			}
+			events |= BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(BX_READ) | BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(BX_WRITE);
+		}
+
+		return events;
+	}
+
+	void update_subscriptions() {
+		Bit32u events = base_subscriptions;
 
-			return true;
+		// The replayer needs to see every linear access of an instruction that could page fault as it happens
+		if (replayer.is_page_fault_expected()) {
+			events |= BX_INSTR_SUBSCRIBE_LIN_ACCESS_CALLBACK;
 		}
 
-		bx_address get_linear_address(bx_phy_address phys) {
-			if (phys == phys1_) {
-				return lin1_;
-			} else if (phys == phys2_) {
-				return lin2_;
+		bx_instr_subscriptions = events;
+	}
+
+	void end_of_scenario(unsigned cpu, bool desync) {
+		replayer.end_of_scenario(cpu, desync);
+	}
+
+	// The linear part of the RMW accesses of the current instruction of each CPU, to match their physical write
+	struct RmwAccess {
+		bx_address lin;
+		bx_phy_address phy;
+		unsigned len;
+	};
+	std::vector<RmwAccess> rmw_reads[BX_SMP_PROCESSORS];
+
+	void memory_access(unsigned cpu, bool is_linear, bx_address lin, bx_phy_address phy, unsigned len, unsigned rw, const std::uint8_t* data) {
+		if (is_linear and rw == BX_RW) {
+			rmw_reads[cpu].push_back({lin, phy, len});
+
+			// If we are in the middle of an rmw operation we want to tell the tracer that is a read because we didn't do the write yet
+			if (tracer)
+				tracer->linear_memory_access(cpu, lin, phy, len, data, true, false, false);
+
+			if (memhist_tracer)
+				memhist_tracer->linear_memory_access(cpu, lin, phy, len, data, true, false, false);
+		} else if (rw == BX_RW) {
+			// To handle read_RMW_linear_dqword_aligned_64 followed by write_RMW_linear_dqword, the write can land in the middle of the read
+			auto rmw_read = std::find_if(rmw_reads[cpu].begin(), rmw_reads[cpu].end(), [phy](const RmwAccess& read) {
+				return read.phy <= phy and phy < read.phy + read.len;
+			});
+
+			bx_address rmw_lin = 0;
+			if (rmw_read == rmw_reads[cpu].end()) {
+				LOG_DESYNC(cpu, "Physical access in Read/Write without matching linear access at " << std::hex << phy << " (" << std::dec << len << " bytes" << ")")
 			} else {
-				return 0;
+				rmw_lin = rmw_read->lin + (phy - rmw_read->phy);
 			}
-		}
 
-	private:
-		bx_address lin1_{0};
-		bx_address lin2_{0};
+			// We don't have to call replayer.linear_access because it should already have launch a pagefault if necessary
+			if (tracer)
+				tracer->linear_memory_access(cpu, rmw_lin, phy, len, data, false, true, false);
 
-		bx_phy_address phys1_{0};
-		bx_phy_address phys2_{0};
-	} current_rmw_operation;
+			if (memhist_tracer)
+				memhist_tracer->linear_memory_access(cpu, rmw_lin, phy, len, data, false, true, false);
+		} else if (is_linear) {
+			if (tracer)
+				tracer->linear_memory_access(cpu, lin, phy, len, data, rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
 
-	void end_of_scenario(unsigned cpu, bool desync) {
-		replayer.end_of_scenario(cpu, desync);
+			if (memhist_tracer)
+				memhist_tracer->linear_memory_access(cpu, lin, phy, len, data, rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+		} else {
+			if (tracer)
+				tracer->physical_memory_access(cpu, phy, len, data, rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+
+			if (memhist_tracer)
+				memhist_tracer->physical_memory_access(cpu, phy, len, data, rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+		}
 	}
 }
 
@@ -66,134 +122,179 @@ std::uint64_t reven_icount(void) {
 	return tick_counter.icount();
 }
 
+bool reven_icount_started(void) {
+	return tick_counter.started();
+}
+
 void bx_instr_init_env(void) {}
 void bx_instr_exit_env(void) {}
 
-void bx_instr_initialize(unsigned /* cpu */) {}
+void bx_instr_initialize(unsigned cpu) {
+	assert(cpu < BX_SMP_PROCESSORS);
+
+	if (bx_instr_access_logs == NULL)
+		bx_instr_access_logs = new bx_instr_access_log_t[BX_SMP_PROCESSORS]();
+
+	base_subscriptions = output_subscriptions();
+	bx_instr_subscriptions = base_subscriptions;
+}
 void bx_instr_exit(unsigned /* cpu */) {}
 
 void bx_instr_reset(unsigned /* cpu */, unsigned /* type */) {}
-void bx_instr_hlt(unsigned /* cpu */) {}
-void bx_instr_mwait(unsigned /* cpu */, bx_phy_address /* addr */, unsigned /* len */, Bit32u /* flags */) {}
 
 void bx_instr_debug_promt() {}
 void bx_instr_debug_cmd(const char* /* cmd */) {}
 
-void bx_instr_cnear_branch_taken(unsigned /* cpu */, bx_address /* branch_eip */, bx_address /* new_eip */) {}
-void bx_instr_cnear_branch_not_taken(unsigned /* cpu */, bx_address /* branch_eip */) {}
-void bx_instr_ucnear_branch(unsigned /* cpu */, unsigned /* what */, bx_address /* branch_eip */, bx_address /* new_eip */) {}
-void bx_instr_far_branch(unsigned /* cpu */, unsigned /* what */, Bit16u /* prev_cs */, bx_address /* prev_eip */, Bit16u /* new_cs */, bx_address /* new_eip */) {}
-
-void bx_instr_opcode(unsigned /* cpu */, bxInstruction_c* /* i */, const Bit8u* /* opcode */, unsigned /* len */, bx_bool /* is32 */, bx_bool /* is64 */) {}
-
 void bx_instr_interrupt(unsigned cpu, unsigned vector) {
-	tick_counter.break_and_start_new_instruction();
+	// The accesses of the previous instruction are flushed by BX_INSTR_ICOUNT_BOUNDARY
+	rmw_reads[cpu].clear();
+
+	auto start = telemetry.start_timer();
 
 	rip_repeat_iteration = std::experimental::nullopt;
 
 	if (tracer)
 		tracer->interrupt(cpu, vector);
 	replayer.interrupt(cpu, vector);
+
+	telemetry.stop_timer(reven::util::Telemetry::CallbackInterrupt, start);
 }
 
 void bx_instr_exception(unsigned cpu, unsigned vector, unsigned error_code) {
+	bx_instr_flush_accesses(cpu);
+	rmw_reads[cpu].clear();
+
+	auto start = telemetry.start_timer();
+
 	rip_repeat_iteration = std::experimental::nullopt;
 
 	if (tracer)
 		tracer->exception(cpu, vector, error_code, replayer);
 	replayer.exception(cpu, vector, error_code);
-}
 
-void bx_instr_hwinterrupt(unsigned /* cpu */, unsigned /* vector */, Bit16u /* cs */, bx_address /* eip */) {}
+	telemetry.stop_timer(reven::util::Telemetry::CallbackException, start);
+}
 
-void bx_instr_tlb_cntrl(unsigned /* cpu */, unsigned /* what */, bx_phy_address /* new_cr3 */) {}
-void bx_instr_clflush(unsigned /* cpu */, bx_address /* laddr */, bx_phy_address /* paddr */) {}
-void bx_instr_cache_cntrl(unsigned /* cpu */, unsigned /* what */) {}
-void bx_instr_prefetch_hint(unsigned /* cpu */, unsigned /* what */, unsigned /* seg */, bx_address /* offset */) {}
+void bx_instr_tlb_cntrl(unsigned /* cpu */, unsigned what, bx_phy_address /* new_cr3 */) {
+	switch (what) {
+		case BX_INSTR_MOV_CR0: // Can change EFER.LMA
+		case BX_INSTR_TASK_SWITCH:
+		case BX_INSTR_CONTEXT_SWITCH:
+			if (tracer)
+				tracer->mark_registers_dirty(reven::tracer::RegisterClassAll);
+			break;
+		default:
+			break;
+	}
+}
 
 void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i) {
-	// Dump the current instruction in the trace only if we aren't in repeat iteration
-	if (!rip_repeat_iteration or rip_repeat_iteration != BX_CPU(cpu)->prev_rip) {
-		tick_counter.before_instruction();
+	// The accesses done outside of an instruction (e.g. while delivering an interrupt) are flushed
+	// by BX_INSTR_ICOUNT_BOUNDARY, before the icount of this instruction
+	rmw_reads[cpu].clear();
 
-		if (tracer) {
-			tracer->execute_instruction(cpu, replayer);
-		}
+	auto start = telemetry.start_timer();
+
+	// Dump the current instruction in the trace only if we aren't in repeat iteration
+	if (tracer and (!rip_repeat_iteration or rip_repeat_iteration != BX_CPU(cpu)->prev_rip)) {
+		tracer->execute_instruction(cpu, replayer);
 	}
 
 	replayer.before_instruction(cpu, i);
 	rip_repeat_iteration = std::experimental::nullopt;
+	update_subscriptions();
+
+	telemetry.stop_timer(reven::util::Telemetry::CallbackBeforeExecution, start);
 }
 
 void bx_instr_after_execution(unsigned cpu, bxInstruction_c *i) {
+	bx_instr_flush_accesses(cpu);
+	rmw_reads[cpu].clear();
+
+	auto start = telemetry.start_timer();
+
+	if (tracer)
+		tracer->after_instruction(i, replayer);
+
 	replayer.after_instruction(cpu, i);
-	current_rmw_operation.clear();
+
+	telemetry.stop_timer(reven::util::Telemetry::CallbackAfterExecution, start);
 }
 
 void bx_instr_repeat_iteration(unsigned cpu , bxInstruction_c* /* i */) {
+	bx_instr_flush_accesses(cpu);
+
 	rip_repeat_iteration.emplace(BX_CPU(cpu)->prev_rip);
 }
 
-void bx_instr_inp(Bit16u /* addr */, unsigned /* len */) {}
-void bx_instr_inp2(Bit16u /* addr */, unsigned /* len */, unsigned /* val */) {}
-void bx_instr_outp(Bit16u /* addr */, unsigned /* len */, unsigned /* val */) {}
+void bx_instr_icount_target(unsigned cpu, Bit64u /* icount */) {
+	// Reached the maximum icount of the replay
+	end_of_scenario(cpu, false);
+}
 
-void bx_instr_lin_access(unsigned cpu, bx_address lin, bx_address phy, unsigned len, unsigned /* memtype */, unsigned rw, Bit8u* data) {
-	replayer.linear_access(cpu, lin, rw);
+bx_bool bx_instr_trace_instrumented(unsigned /* cpu */, bxInstruction_c *i, unsigned len) {
+	// The outputs need every instruction, and the accesses of the REP instructions
+	if (tracer or memhist_tracer)
+		return 1;
 
-	if (rw == BX_RW) {
-		if (len == 16) {
-			// To handle read_RMW_linear_dqword_aligned_64 followed by write_RMW_linear_dqword
-			if (!current_rmw_operation.register_new_access(lin, phy)) {
-				LOG_DESYNC(cpu, "More than two accesses in a RMW operation");
-			}
+	return replayer.is_trace_instrumented(i, len);
+}
 
-			if (!current_rmw_operation.register_new_access(lin + 8, phy + 8)) {
-				LOG_DESYNC(cpu, "More than two accesses in a RMW operation");
-			}
-		} else if (!current_rmw_operation.register_new_access(lin, phy)) {
-			LOG_DESYNC(cpu, "More than two accesses in a RMW operation");
-		}
+void bx_instr_trace_enter(unsigned cpu, unsigned len) {
+	if (reven_icount_started())
+		telemetry.tick(reven_icount());
 
-		// If we are in the middle of an rmw operation we want to tell the tracer that is a read because we didn't do the write yet
-		if (tracer)
-			tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), true, false, false);
+	// Only the traces that could reach the next sync event need the execution callbacks
+	if (!BX_CPU(cpu)->get_trace_instrumented() and replayer.is_trace_needed(cpu, len))
+		BX_CPU(cpu)->set_trace_instrumented(1);
+}
 
-		if (memhist_tracer)
-			memhist_tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), true, false, false);
-	} else {
-		if (tracer)
-			tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+void bx_instr_lin_access(unsigned cpu, bx_address lin, bx_address /* phy */, unsigned /* len */, unsigned /* memtype */, unsigned rw, Bit8u* /* data */) {
+	auto start = telemetry.start_timer();
 
-		if (memhist_tracer)
-			memhist_tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
-	}
+	replayer.linear_access(cpu, lin, rw);
+
+	telemetry.stop_timer(reven::util::Telemetry::CallbackLinearAccess, start);
 }
 
-void bx_instr_phy_access(unsigned cpu, bx_address phy, unsigned len, unsigned /* memtype */, unsigned rw, Bit8u* data) {
-	if (rw == BX_RW) {
-		bx_address lin = current_rmw_operation.get_linear_address(phy);
+void bx_instr_flush_accesses(unsigned cpu) {
+	bx_instr_access_log_t& log = bx_instr_access_logs[cpu];
 
-		if (lin == 0) {
-			LOG_DESYNC(cpu, "Physical access in Read/Write without matching linear access at " << std::hex << phy << " (" << std::dec << len << " bytes" << ")")
-		}
+	if (log.count == 0)
+		return;
+
+	auto start = telemetry.start_timer();
+
+	for (unsigned index = 0; index < log.count; ++index) {
+		const auto& access = log.accesses[index];
+		memory_access(cpu, access.is_linear, access.lin, access.phy, access.len, access.rw, log.data + access.data_offset);
+	}
 
-		// We don't have to call replayer.linear_access because it should already have launch a pagefault if necessary
-		if (tracer)
-			tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), false, true, false);
+	log.count = 0;
+	log.data_size = 0;
 
-		if (memhist_tracer)
-			memhist_tracer->linear_memory_access(lin, phy, len, reinterpret_cast<const std::uint8_t*>(data), false, true, false);
-	} else {
-		if (tracer)
-			tracer->physical_memory_access(phy, len, reinterpret_cast<const std::uint8_t*>(data), rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+	telemetry.stop_timer(reven::util::Telemetry::CallbackAccessLog, start);
+}
+
+void bx_instr_log_access_slow(unsigned cpu, bx_bool is_linear, bx_address lin, bx_phy_address phy, unsigned len, unsigned rw, const Bit8u* data) {
+	bx_instr_flush_accesses(cpu);
 
-		if (memhist_tracer)
-			memhist_tracer->physical_memory_access(phy, len, reinterpret_cast<const std::uint8_t*>(data), rw == BX_READ, rw == BX_WRITE, rw == BX_EXECUTE);
+	// An access too big for the log is delivered directly
+	if (len > bx_instr_access_log_t::max_data) {
+		memory_access(cpu, is_linear, lin, phy, len, rw, data);
+		return;
 	}
+
+	bx_instr_log_access(cpu, is_linear, lin, phy, len, rw, data);
 }
 
 void bx_instr_dev_phy_access(bx_address phy, unsigned len, unsigned rw, Bit8u* data) {
+	// Keep the order of the accesses in the outputs
+	for (unsigned cpu = 0; cpu < BX_SMP_PROCESSORS; ++cpu)
+		bx_instr_flush_accesses(cpu);
+
+	auto start = telemetry.start_timer();
+
 	if (rw == BX_RW) {
 		LOG_DESYNC(0, "Physical access in Read/Write from a device at " << std::hex << phy << " (" << std::dec << len << " bytes" << ")")
 	}
@@ -203,8 +304,11 @@ void bx_instr_dev_phy_access(bx_address phy, unsigned len, unsigned rw, Bit8u* d
 
 	if (memhist_tracer)
 		memhist_tracer->device_physical_memory_access(phy, len, reinterpret_cast<const std::uint8_t*>(data), rw == BX_READ, rw == BX_WRITE);
-}
 
-void bx_instr_wrmsr(unsigned /* cpu */, unsigned /* addr */, Bit64u /* value */) {}
+	telemetry.stop_timer(reven::util::Telemetry::CallbackDevicePhysicalAccess, start);
+}
 
-void bx_instr_vmexit(unsigned /* cpu */, Bit32u /* reason */, Bit64u /* qualification */) {}
+void bx_instr_wrmsr(unsigned /* cpu */, unsigned /* addr */, Bit64u /* value */) {
+	if (tracer)
+		tracer->mark_registers_dirty(reven::tracer::RegisterClassMsr);
+}
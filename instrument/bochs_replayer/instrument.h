@@ -13,43 +13,87 @@ void bx_instr_exit_env(void);
 void bx_instr_initialize(unsigned cpu);
 void bx_instr_exit(unsigned cpu);
 void bx_instr_reset(unsigned cpu, unsigned type);
-void bx_instr_hlt(unsigned cpu);
-void bx_instr_mwait(unsigned cpu, bx_phy_address addr, unsigned len, Bit32u flags);
 
 void bx_instr_debug_promt();
 void bx_instr_debug_cmd(const char *cmd);
 
-void bx_instr_cnear_branch_taken(unsigned cpu, bx_address branch_eip, bx_address new_eip);
-void bx_instr_cnear_branch_not_taken(unsigned cpu, bx_address branch_eip);
-void bx_instr_ucnear_branch(unsigned cpu, unsigned what, bx_address branch_eip, bx_address new_eip);
-void bx_instr_far_branch(unsigned cpu, unsigned what, Bit16u prev_cs, bx_address prev_eip, Bit16u new_cs, bx_address new_eip);
-
-void bx_instr_opcode(unsigned cpu, bxInstruction_c *i, const Bit8u *opcode, unsigned len, bx_bool is32, bx_bool is64);
-
 void bx_instr_interrupt(unsigned cpu, unsigned vector);
 void bx_instr_exception(unsigned cpu, unsigned vector, unsigned error_code);
-void bx_instr_hwinterrupt(unsigned cpu, unsigned vector, Bit16u cs, bx_address eip);
 
 void bx_instr_tlb_cntrl(unsigned cpu, unsigned what, bx_phy_address new_cr3);
-void bx_instr_cache_cntrl(unsigned cpu, unsigned what);
-void bx_instr_prefetch_hint(unsigned cpu, unsigned what, unsigned seg, bx_address offset);
-void bx_instr_clflush(unsigned cpu, bx_address laddr, bx_phy_address paddr);
 
 void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
 void bx_instr_after_execution(unsigned cpu, bxInstruction_c *i);
 void bx_instr_repeat_iteration(unsigned cpu, bxInstruction_c *i);
-
-void bx_instr_inp(Bit16u addr, unsigned len);
-void bx_instr_inp2(Bit16u addr, unsigned len, unsigned val);
-void bx_instr_outp(Bit16u addr, unsigned len, unsigned val);
+void bx_instr_icount_target(unsigned cpu, Bit64u icount);
+bx_bool bx_instr_trace_instrumented(unsigned cpu, bxInstruction_c *i, unsigned len);
+void bx_instr_trace_enter(unsigned cpu, unsigned len);
 
 void bx_instr_lin_access(unsigned cpu, bx_address lin, bx_address phy, unsigned len, unsigned memtype, unsigned rw, Bit8u* data);
-void bx_instr_phy_access(unsigned cpu, bx_address phy, unsigned len, unsigned memtype, unsigned rw, Bit8u* data);
 void bx_instr_dev_phy_access(bx_address phy, unsigned len, unsigned rw, Bit8u* data);
 
 void bx_instr_wrmsr(unsigned cpu, unsigned addr, Bit64u value);
 
-void bx_instr_vmexit(unsigned cpu, Bit32u reason, Bit64u qualification);
+/* events delivered only when subscribed to in bx_instr_subscriptions,
+   the memory accesses are subscribed to per kind of access (BX_READ, BX_WRITE, BX_EXECUTE or BX_RW) */
+#define BX_INSTR_SUBSCRIBE_LIN_ACCESS(rw)     (1u << (rw))
+#define BX_INSTR_SUBSCRIBE_PHY_ACCESS(rw)     (1u << (4 + (rw)))
+#define BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(rw) (1u << (8 + (rw)))
+#define BX_INSTR_SUBSCRIBE_TLB_CNTRL          (1u << 12)
+#define BX_INSTR_SUBSCRIBE_WRMSR              (1u << 13)
+/* bx_instr_lin_access is called on each linear access, the subscribed ones are also logged */
+#define BX_INSTR_SUBSCRIBE_LIN_ACCESS_CALLBACK (1u << 14)
+
+extern Bit32u bx_instr_subscriptions;
+
+#define BX_INSTR_SUBSCRIBED(events) (bx_instr_subscriptions & (events))
+
+/* CPU memory accesses, logged per CPU as they happen and handed to the outputs in a single pass
+   by bx_instr_flush_accesses (at each instruction boundary, or when the log is full) */
+struct bx_instr_access_log_t {
+  enum { max_accesses = 256, max_data = 16384 };
+
+  struct {
+    bx_address lin;
+    bx_phy_address phy;
+    Bit32u data_offset;
+    Bit16u len;
+    Bit8u rw;
+    Bit8u is_linear;
+  } accesses[max_accesses];
+
+  unsigned count;
+  unsigned data_size;
+
+  Bit8u data[max_data];
+};
+
+/* one log per CPU, allocated by bx_instr_initialize */
+extern bx_instr_access_log_t *bx_instr_access_logs;
+
+void bx_instr_flush_accesses(unsigned cpu);
+void bx_instr_log_access_slow(unsigned cpu, bx_bool is_linear, bx_address lin, bx_phy_address phy, unsigned len, unsigned rw, const Bit8u *data);
+
+inline void bx_instr_log_access(unsigned cpu, bx_bool is_linear, bx_address lin, bx_phy_address phy, unsigned len, unsigned rw, const Bit8u *data)
+{
+  bx_instr_access_log_t &log = bx_instr_access_logs[cpu];
+
+  if (log.count == bx_instr_access_log_t::max_accesses || log.data_size + len > bx_instr_access_log_t::max_data) {
+    bx_instr_log_access_slow(cpu, is_linear, lin, phy, len, rw, data);
+    return;
+  }
+
+  log.accesses[log.count].lin = lin;
+  log.accesses[log.count].phy = phy;
+  log.accesses[log.count].data_offset = log.data_size;
+  log.accesses[log.count].len = (Bit16u) len;
+  log.accesses[log.count].rw = (Bit8u) rw;
+  log.accesses[log.count].is_linear = (Bit8u) is_linear;
+  log.count++;
+
+  memcpy(log.data + log.data_size, data, len);
+  log.data_size += len;
+}
 
 /* initialization/deinitialization of instrumentalization*/
 #define BX_INSTR_INIT_ENV() bx_instr_init_env()
@@ -59,39 +103,54 @@ void bx_instr_vmexit(unsigned cpu, Bit32u reason, Bit64u qualification);
 #define BX_INSTR_INITIALIZE(cpu_id)      bx_instr_initialize(cpu_id)
 #define BX_INSTR_EXIT(cpu_id)            bx_instr_exit(cpu_id)
 #define BX_INSTR_RESET(cpu_id, type)     bx_instr_reset(cpu_id, type)
-#define BX_INSTR_HLT(cpu_id)             bx_instr_hlt(cpu_id)
 
-#define BX_INSTR_MWAIT(cpu_id, addr, len, flags) \
-                       bx_instr_mwait(cpu_id, addr, len, flags)
+/* the replayer has no use of the following events, they are compiled out */
+#define BX_INSTR_HLT(cpu_id)
+#define BX_INSTR_MWAIT(cpu_id, addr, len, flags)
 
 /* called from command line debugger */
 #define BX_INSTR_DEBUG_PROMPT()          bx_instr_debug_promt()
 #define BX_INSTR_DEBUG_CMD(cmd)          bx_instr_debug_cmd(cmd)
 
 /* branch resolution */
-#define BX_INSTR_CNEAR_BRANCH_TAKEN(cpu_id, branch_eip, new_eip) bx_instr_cnear_branch_taken(cpu_id, branch_eip, new_eip)
-#define BX_INSTR_CNEAR_BRANCH_NOT_TAKEN(cpu_id, branch_eip) bx_instr_cnear_branch_not_taken(cpu_id, branch_eip)
-#define BX_INSTR_UCNEAR_BRANCH(cpu_id, what, branch_eip, new_eip) bx_instr_ucnear_branch(cpu_id, what, branch_eip, new_eip)
-#define BX_INSTR_FAR_BRANCH(cpu_id, what, prev_cs, prev_eip, new_cs, new_eip) \
-                       bx_instr_far_branch(cpu_id, what, prev_cs, prev_eip, new_cs, new_eip)
+#define BX_INSTR_CNEAR_BRANCH_TAKEN(cpu_id, branch_eip, new_eip)
+#define BX_INSTR_CNEAR_BRANCH_NOT_TAKEN(cpu_id, branch_eip)
+#define BX_INSTR_UCNEAR_BRANCH(cpu_id, what, branch_eip, new_eip)
+#define BX_INSTR_FAR_BRANCH(cpu_id, what, prev_cs, prev_eip, new_cs, new_eip)
 
 /* decoding completed */
-#define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64) \
-                       bx_instr_opcode(cpu_id, i, opcode, len, is32, is64)
+#define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
+
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) bx_instr_trace_instrumented(cpu_id, i, len)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len) bx_instr_trace_enter(cpu_id, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount) bx_instr_icount_target(cpu_id, icount)
+
+/* instruction or interrupt about to be counted, the accesses logged so far belong to the previous one */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id) do { \
+  if (bx_instr_access_logs[cpu_id].count != 0) \
+    bx_instr_flush_accesses(cpu_id); \
+} while (0)
 
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code) \
                 bx_instr_exception(cpu_id, vector, error_code)
 
 #define BX_INSTR_INTERRUPT(cpu_id, vector) bx_instr_interrupt(cpu_id, vector)
-#define BX_INSTR_HWINTERRUPT(cpu_id, vector, cs, eip) bx_instr_hwinterrupt(cpu_id, vector, cs, eip)
+#define BX_INSTR_HWINTERRUPT(cpu_id, vector, cs, eip)
 
 /* TLB/CACHE control instruction executed */
-#define BX_INSTR_CLFLUSH(cpu_id, laddr, paddr)    bx_instr_clflush(cpu_id, laddr, paddr)
-#define BX_INSTR_CACHE_CNTRL(cpu_id, what)        bx_instr_cache_cntrl(cpu_id, what)
-#define BX_INSTR_TLB_CNTRL(cpu_id, what, new_cr3) bx_instr_tlb_cntrl(cpu_id, what, new_cr3)
-#define BX_INSTR_PREFETCH_HINT(cpu_id, what, seg, offset) \
-                       bx_instr_prefetch_hint(cpu_id, what, seg, offset)
+#define BX_INSTR_CLFLUSH(cpu_id, laddr, paddr)
+#define BX_INSTR_CACHE_CNTRL(cpu_id, what)
+#define BX_INSTR_TLB_CNTRL(cpu_id, what, new_cr3) do { \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_TLB_CNTRL)) \
+    bx_instr_tlb_cntrl(cpu_id, what, new_cr3); \
+} while (0)
+#define BX_INSTR_PREFETCH_HINT(cpu_id, what, seg, offset)
 
 /* execution */
 #define BX_INSTR_BEFORE_EXECUTION(cpu_id, i)  bx_instr_before_execution(cpu_id, i)
@@ -99,24 +158,38 @@ void bx_instr_vmexit(unsigned cpu, Bit32u reason, Bit64u qualification);
 #define BX_INSTR_REPEAT_ITERATION(cpu_id, i)  bx_instr_repeat_iteration(cpu_id, i)
 
 /* linear memory access */
-#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw, dataptr)  bx_instr_lin_access(cpu_id, lin, phy, len, memtype, rw, dataptr)
+#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw, dataptr) do { \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_LIN_ACCESS_CALLBACK)) \
+    bx_instr_lin_access(cpu_id, lin, phy, len, memtype, rw, dataptr); \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_LIN_ACCESS(rw))) \
+    bx_instr_log_access(cpu_id, 1, lin, phy, len, rw, dataptr); \
+} while (0)
 
 /* physical memory access */
-#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw, dataptr)  bx_instr_phy_access(cpu_id, phy, len, memtype, rw, dataptr)
+#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw, dataptr) do { \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_PHY_ACCESS(rw))) \
+    bx_instr_log_access(cpu_id, 0, 0, phy, len, rw, dataptr); \
+} while (0)
 
 /* physical memory access by a device */
-#define BX_INSTR_DEV_PHY_ACCESS(phy, len, rw, dataptr) bx_instr_dev_phy_access(phy, len, rw, dataptr)
+#define BX_INSTR_DEV_PHY_ACCESS(phy, len, rw, dataptr) do { \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_DEV_PHY_ACCESS(rw))) \
+    bx_instr_dev_phy_access(phy, len, rw, dataptr); \
+} while (0)
 
 /* feedback from device units */
-#define BX_INSTR_INP(addr, len)               bx_instr_inp(addr, len)
-#define BX_INSTR_INP2(addr, len, val)         bx_instr_inp2(addr, len, val)
-#define BX_INSTR_OUTP(addr, len, val)         bx_instr_outp(addr, len, val)
+#define BX_INSTR_INP(addr, len)
+#define BX_INSTR_INP2(addr, len, val)
+#define BX_INSTR_OUTP(addr, len, val)
 
 /* wrmsr callback */
-#define BX_INSTR_WRMSR(cpu_id, addr, value)   bx_instr_wrmsr(cpu_id, addr, value)
+#define BX_INSTR_WRMSR(cpu_id, addr, value) do { \
+  if (BX_INSTR_SUBSCRIBED(BX_INSTR_SUBSCRIBE_WRMSR)) \
+    bx_instr_wrmsr(cpu_id, addr, value); \
+} while (0)
 
 /* vmexit callback */
-#define BX_INSTR_VMEXIT(cpu_id, reason, qualification) bx_instr_vmexit(cpu_id, reason, qualification)
+#define BX_INSTR_VMEXIT(cpu_id, reason, qualification)
 
 #else
 
@@ -144,6 +217,18 @@ void bx_instr_vmexit(unsigned cpu, Bit32u reason, Bit64u qualification);
 /* decoding completed */
 #define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
 
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) (0)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount)
+
+/* instruction or interrupt about to be counted in the architectural instruction count */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id)
+
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code)
 #define BX_INSTR_INTERRUPT(cpu_id, vector)
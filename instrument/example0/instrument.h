@@ -73,6 +73,18 @@ void bx_instr_lin_access(unsigned cpu, bx_address lin, bx_phy_address phy, unsig
 /* decoding completed */
 #define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
 
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) (1)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount)
+
+/* instruction or interrupt about to be counted in the architectural instruction count */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id)
+
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code) \
                        bx_instr_exception(cpu_id, vector, error_code)
@@ -134,6 +146,18 @@ void bx_instr_lin_access(unsigned cpu, bx_address lin, bx_phy_address phy, unsig
 /* decoding completed */
 #define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
 
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) (0)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount)
+
+/* instruction or interrupt about to be counted in the architectural instruction count */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id)
+
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code)
 #define BX_INSTR_INTERRUPT(cpu_id, vector)
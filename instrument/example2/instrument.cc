@@ -24,6 +24,7 @@
 
 #include "bochs.h"
 #include "cpu/cpu.h"
+#include "cpu/decoder/ia_opcodes.h"
 
 #define BX_IA_STATS_ENTRIES (BX_IA_LAST*2) /* /r and /m form */
 
@@ -33,6 +34,7 @@ static struct bx_instr_ia_stats {
    Bit32u total_cnt;
    Bit32u interrupts;
    Bit32u exceptions;
+   Bit32u traces;
 } *ia_stats;
 
 static logfunctions *instrument_log = new logfunctions ();
@@ -58,7 +60,7 @@ void bx_instr_reset(unsigned cpu, unsigned type)
   for(int n=0; n < BX_IA_STATS_ENTRIES; n++)
     ia_stats[cpu].ia_cnt[n] = 0;
 
-  ia_stats[cpu].interrupts = ia_stats[cpu].exceptions = 0;
+  ia_stats[cpu].interrupts = ia_stats[cpu].exceptions = ia_stats[cpu].traces = 0;
 }
 
 void bx_instr_interrupt(unsigned cpu, unsigned vector)
@@ -76,6 +78,15 @@ void bx_instr_hwinterrupt(unsigned cpu, unsigned vector, Bit16u cs, bx_address e
   if(ia_stats[cpu].active) ia_stats[cpu].interrupts++;
 }
 
+void bx_instr_trace_enter(unsigned cpu, bx_address laddr, bx_phy_address paddr, unsigned ninstr, unsigned len)
+{
+  // every instruction is at least one and at most 15 bytes long
+  assert(ninstr > 0 && ninstr <= BX_MAX_TRACE_LENGTH);
+  assert(len >= ninstr && len <= ninstr * 15);
+
+  if(ia_stats[cpu].active) ia_stats[cpu].traces++;
+}
+
 #define IA_CNT_DUMP_THRESHOLD 100000000 /* 100M */
 
 void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i)
@@ -88,6 +99,7 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i)
       printf("Dump IA stats for CPU %u\n", cpu);
       printf("----------------------------------------------------------\n");
       printf("Interrupts: %d, Exceptions: %d\n", ia_stats[cpu].interrupts, ia_stats[cpu].exceptions);
+      printf("Traces: %d, %f instructions per trace\n", ia_stats[cpu].traces, ia_stats[cpu].traces ? (float) ia_stats[cpu].total_cnt / ia_stats[cpu].traces : 0.0f);
       while(1) {
         Bit32u max = 0, max_index = 0;
         for (int n=0;n < BX_IA_STATS_ENTRIES; n++) {
@@ -100,7 +112,7 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i)
         printf("%s /%c: %f%%\n", get_bx_opcode_name(max_index/2), (max_index & 1) ? 'm' : 'r', ia_stats[cpu].ia_cnt[max_index] * 100.0f / ia_stats[cpu].total_cnt);
         ia_stats[cpu].ia_cnt[max_index] = 0;
       }
-      ia_stats[cpu].interrupts = ia_stats[cpu].exceptions = ia_stats[cpu].total_cnt = 0;
+      ia_stats[cpu].interrupts = ia_stats[cpu].exceptions = ia_stats[cpu].total_cnt = ia_stats[cpu].traces = 0;
     }
   }
 }
@@ -36,6 +36,7 @@ void bx_instr_exception(unsigned cpu, unsigned vector, unsigned error_code);
 void bx_instr_hwinterrupt(unsigned cpu, unsigned vector, Bit16u cs, bx_address eip);
 
 void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
+void bx_instr_trace_enter(unsigned cpu, bx_address laddr, bx_phy_address paddr, unsigned ninstr, unsigned len);
 
 /* initialization/deinitialization of instrumentalization*/
 #define BX_INSTR_INIT_ENV()
@@ -62,6 +63,19 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
 /* decoding completed */
 #define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
 
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) (1)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len) \
+                       bx_instr_trace_enter(cpu_id, laddr, paddr, ninstr, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount)
+
+/* instruction or interrupt about to be counted in the architectural instruction count */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id)
+
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code) \
                        bx_instr_exception(cpu_id, vector, error_code)
@@ -82,10 +96,13 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
 #define BX_INSTR_REPEAT_ITERATION(cpu_id, i)
 
 /* linear memory access */
-#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw)
+#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw, dataptr)
 
 /* physical memory access */
-#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw)
+#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw, dataptr)
+
+/* physical memory access by a device */
+#define BX_INSTR_DEV_PHY_ACCESS(phy, len, rw, dataptr)
 
 /* feedback from device units */
 #define BX_INSTR_INP(addr, len)
@@ -125,6 +142,18 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
 /* decoding completed */
 #define BX_INSTR_OPCODE(cpu_id, i, opcode, len, is32, is64)
 
+/* trace built in the instruction cache, 0 to execute it without the execution callbacks */
+#define BX_INSTR_TRACE_INSTRUMENTED(cpu_id, paddr, i, len) (0)
+
+/* trace entered, 'ninstr' instructions in 'len' bytes at linear address 'laddr' */
+#define BX_INSTR_TRACE_ENTER(cpu_id, laddr, paddr, ninstr, len)
+
+/* architectural instruction count reached the target set with set_icount_target() */
+#define BX_INSTR_ICOUNT_TARGET(cpu_id, icount)
+
+/* instruction or interrupt about to be counted in the architectural instruction count */
+#define BX_INSTR_ICOUNT_BOUNDARY(cpu_id)
+
 /* exceptional case and interrupt */
 #define BX_INSTR_EXCEPTION(cpu_id, vector, error_code)
 #define BX_INSTR_INTERRUPT(cpu_id, vector)
@@ -142,10 +171,13 @@ void bx_instr_before_execution(unsigned cpu, bxInstruction_c *i);
 #define BX_INSTR_REPEAT_ITERATION(cpu_id, i)
 
 /* linear memory access */
-#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw)
+#define BX_INSTR_LIN_ACCESS(cpu_id, lin, phy, len, memtype, rw, dataptr)
 
 /* physical memory access */
-#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw)
+#define BX_INSTR_PHY_ACCESS(cpu_id, phy, len, memtype, rw, dataptr)
+
+/* physical memory access by a device */
+#define BX_INSTR_DEV_PHY_ACCESS(phy, len, rw, dataptr)
 
 /* feedback from device units */
 #define BX_INSTR_INP(addr, len)
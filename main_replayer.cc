@@ -25,10 +25,12 @@
 #include "iodev/iodev.h"
 
 // TETRANE INCLUDE
+#include <algorithm>
 #include <experimental/optional>
 #include <boost/program_options.hpp>
 
 #include "tetrane/bochs_replayer/util/log.h"
+#include "tetrane/bochs_replayer/util/telemetry.h"
 #include "tetrane/bochs_replayer/replayer/replayer.h"
 #include "tetrane/bochs_replayer/tracer/tracer.h"
 #include "tetrane/bochs_replayer/memhist_tracer/memhist_tracer.h"
@@ -80,6 +82,7 @@ namespace reven {
 namespace util {
 
 std::uint8_t verbose_level;
+Telemetry telemetry;
 
 }
 }
@@ -88,6 +91,9 @@ reven::replayer::Replayer replayer;
 std::experimental::optional<reven::tracer::Tracer> tracer;
 std::experimental::optional<reven::memhist_tracer::MemhistTracer> memhist_tracer;
 reven::icount::ICount tick_counter;
+
+// Checkpoint to resume the replay from, if any
+static std::string resume_checkpoint;
 // END TETRANE DEFINITION
 
 #if BX_DEBUGGER
@@ -236,6 +242,12 @@ int bxmain(void)
   std::string trace_directory("./");
   std::string memhist_file("./memhist.sqlite");
   std::uint64_t max_icount = std::numeric_limits<std::uint64_t>::max();
+  std::uint64_t cache_frequency = 1000000;
+  std::uint64_t cache_max_dirty_pages = 0;
+  std::string checkpoint_directory;
+  std::uint64_t checkpoint_frequency = 100000;
+  std::string telemetry_file;
+  double telemetry_interval = 1;
 
   namespace progopts = boost::program_options;
 
@@ -248,9 +260,19 @@ int bxmain(void)
             ("core", progopts::value<std::string>(&core_file)->required(), "The input core file")
             ("analyze", progopts::value<std::string>(&analyze_directory)->required(), "The analyze directory")
             ("trace", progopts::value<std::string>(&trace_directory)->implicit_value(trace_directory), "Enable the trace output")
+            ("cache-frequency", progopts::value<std::uint64_t>(&cache_frequency), "Number of instructions between two cache points of the trace (default 1000000)")
+            ("cache-max-dirty-pages", progopts::value<std::uint64_t>(&cache_max_dirty_pages), "Also write a cache point once this many pages were written since the last one (default 0: disabled)")
+            ("coalesce-memory-writes", "Write the adjacent memory writes of an instruction as a single write in the trace")
             ("memhist", progopts::value<std::string>(&memhist_file)->implicit_value(memhist_file), "Enable the memory history output")
             ("max-icount", progopts::value<std::uint64_t>(&max_icount), "Maximum number of instructions replayed")
+            ("checkpoint-dir", progopts::value<std::string>(&checkpoint_directory), "Save checkpoints of the replay in this directory")
+            ("checkpoint-frequency", progopts::value<std::uint64_t>(&checkpoint_frequency), "Number of sync points between two checkpoints (default 100000)")
+            ("resume", "Resume the replay from the latest checkpoint of --checkpoint-dir")
+
+            ("telemetry", progopts::value<std::string>(&telemetry_file), "Periodically write the counters of the replay as JSON lines in this file")
+            ("telemetry-interval", progopts::value<double>(&telemetry_interval), "Number of seconds between two telemetry reports (default 1)")
 
+            ("validate", "Only check that the scenario replays, without any output, and report where it desyncs and the first sync point that diverged (implies --fail-on-desync)")
             ("fail-on-desync", "Return an error code of 1 in case of desync")
 
             ("verbose,v", progopts::value(&verbose)->zero_tokens(), "Verbosity level")
@@ -312,9 +334,21 @@ int bxmain(void)
 
   std::cout << "Bochsrc filename is set to '" << bochsrc_filename << "'" << std::endl;
 
+  if (vars.count("validate")) {
+    if (vars.count("trace") || vars.count("memhist") || vars.count("checkpoint-dir")) {
+      std::cerr << "Error: --validate can't be used with --trace, --memhist or --checkpoint-dir" << std::endl;
+      return 1;
+    }
+  }
+
   if (vars.count("trace")) {
+    if (cache_frequency == 0) {
+      std::cerr << "Error: the cache frequency must be greater than 0" << std::endl;
+      return 1;
+    }
+
     reven::tracer::initialize_register_maps();
-    tracer.emplace(trace_directory);
+    tracer.emplace(trace_directory, cache_frequency, cache_max_dirty_pages, vars.count("coalesce-memory-writes") > 0);
 
     std::cout << "Build trace in " << trace_directory << std::endl;
   }
@@ -329,10 +363,52 @@ int bxmain(void)
     tick_counter = reven::icount::ICount(max_icount);
   }
 
+  if (vars.count("telemetry")) {
+    if (telemetry_interval <= 0) {
+      std::cerr << "Error: the telemetry interval must be greater than 0" << std::endl;
+      return 1;
+    }
+
+    if (!reven::util::telemetry.open(telemetry_file, telemetry_interval)) {
+      std::cerr << "Error: can't open the telemetry file " << telemetry_file << std::endl;
+      return 1;
+    }
+  }
+
+  if (vars.count("resume")) {
+    if (!vars.count("checkpoint-dir")) {
+      std::cerr << "Error: --resume needs --checkpoint-dir" << std::endl;
+      return 1;
+    }
+
+    // The trace and memhist outputs must contain the whole scenario
+    if (tracer || memhist_tracer) {
+      std::cerr << "Error: can't build a trace or a memhist when resuming" << std::endl;
+      return 1;
+    }
+
+    resume_checkpoint = reven::replayer::Replayer::latest_checkpoint(checkpoint_directory);
+    if (resume_checkpoint.empty()) {
+      std::cerr << "Error: no checkpoint found in " << checkpoint_directory << std::endl;
+      return 1;
+    }
+
+    std::cout << "Resume from " << resume_checkpoint << std::endl;
+  }
+
   if (!replayer.load(core_file, analyze_directory)) {
     return 1;
   }
 
+  if (vars.count("checkpoint-dir")) {
+    if (checkpoint_frequency == 0) {
+      std::cerr << "Error: the checkpoint frequency must be greater than 0" << std::endl;
+      return 1;
+    }
+
+    replayer.enable_checkpoints(checkpoint_directory, checkpoint_frequency);
+  }
+
   bx_init_siminterface();   // create the SIM object
 
   BX_INSTR_INIT_ENV();
@@ -346,18 +422,28 @@ int bxmain(void)
   }
 
   try {
+    if (!resume_checkpoint.empty()) {
+      SIM->get_param_bool(BXPN_RESTORE_FLAG)->set(1);
+      SIM->get_param_string(BXPN_RESTORE_PATH)->set(resume_checkpoint.c_str());
+
+      if (!SIM->restore_config()) {
+        LOG_FATAL_ERROR("Can't restore the configuration of " << resume_checkpoint);
+        return 1;
+      }
+    }
+
     // We can't let the user choose the memory size, it must match the one of the original VM during the record
 
-    const auto ram_size = replayer.get_memory_size() / (1024 * 1024);
+    // Bochs wants a whole number of MB, the memory above the RAM of the VM is never touched
+    const auto ram_size = (replayer.get_memory_size() + 1024 * 1024 - 1) / (1024 * 1024);
     std::cerr << "TETRANE: Info: Forcing to use memory of size : " << std::dec << ram_size << " MB" << std::endl;
 
-    if (ram_size > 2048) {
-      LOG_FATAL_ERROR("The RAM of the VMs can't be more than 2048MB");
-      return 1;
-    }
-
     SIM->get_param_num(BXPN_MEM_SIZE)->set(ram_size);
-    SIM->get_param_num(BXPN_HOST_MEM_SIZE)->set(ram_size);
+
+    // The RAM of the VM is mapped from the core file, the host memory only backs the blocks that can't be mapped
+    // and is swapped to the ramfile past its maximum size
+    bx_param_num_c *host_mem_size = SIM->get_param_num(BXPN_HOST_MEM_SIZE);
+    host_mem_size->set(std::min<Bit64s>(ram_size, host_mem_size->get_max()));
 
     BX_INSTR_EXIT_ENV();
 
@@ -367,7 +453,25 @@ int bxmain(void)
     return 1;
   }
 
-  if (vars.count("fail-on-desync") && replayer.get_desync()) {
+  if (vars.count("validate")) {
+    if (replayer.get_desync()) {
+      std::cout << "Validation failed: desync after the sync point $" << std::dec << replayer.get_last_sync_point()
+                << " at #" << replayer.get_end_icount()
+                << " (rip " << std::showbase << std::hex << replayer.get_end_rip() << ")" << std::endl;
+    } else {
+      std::cout << "Validation succeeded: replayed up to #" << std::dec << replayer.get_end_icount()
+                << " and the sync point $" << replayer.get_last_sync_point() << std::endl;
+    }
+
+    // Where the replay started to drift, which can be long before a desync
+    if (const auto& divergence = replayer.get_first_divergence()) {
+      std::cout << "First divergence: sync point $" << std::dec << divergence->sync_point
+                << " at #" << divergence->icount
+                << " (rip " << std::showbase << std::hex << divergence->rip << "): " << divergence->reason << std::endl;
+    }
+  }
+
+  if ((vars.count("fail-on-desync") || vars.count("validate")) && replayer.get_desync()) {
     return 2;
   }
 
@@ -598,18 +702,32 @@ extern bx_bool bx_dbg_read_pmode_descriptor(Bit16u sel, bx_descriptor_t *descrip
 
 void tetrane_simulation() {
   // Reset and launch the execution of the CPU 0
-  replayer.reset(0);
+  if (!resume_checkpoint.empty()) {
+    if (!replayer.resume(0, resume_checkpoint))
+      return;
+
+    tick_counter.resume_after(0, replayer.resumed_icount());
+  } else {
+    replayer.reset(0);
+    tick_counter.reset(0);
+  }
 
   if (tracer)
     tracer->init(0, replayer);
 
   replayer.execute(0);
 
+  // Deliver the accesses of the last instruction of the scenario
+  bx_instr_flush_accesses(0);
+
   if (tracer)
     tracer->end();
 
   if (memhist_tracer)
     memhist_tracer->end();
+
+  if (reven::util::telemetry.enabled() && tick_counter.started())
+    reven::util::telemetry.report(tick_counter.icount());
 }
 
 int bx_begin_simulation(int argc, char *argv[])
@@ -114,6 +114,7 @@ private:
 
   BX_MEM_SMF void   read_block(Bit32u block);
 #endif
+  BX_MEM_SMF bx_bool is_plain_ram_block(Bit32u block);
   BX_MEM_SMF Bit8u flash_read(Bit32u addr);
   BX_MEM_SMF void  flash_write(Bit32u addr, Bit8u data);
 
@@ -148,7 +149,7 @@ public:
   BX_MEM_SMF void    load_RAM(const char *path, bx_phy_address romaddress);
 
   BX_MEM_SMF bx_bool dbg_fetch_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit8u *buf);
-#if (BX_DEBUGGER || BX_GDBSTUB)
+#if (BX_DEBUGGER || BX_GDBSTUB || BX_INSTRUMENTATION)
   BX_MEM_SMF bx_bool dbg_set_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit8u *buf);
   BX_MEM_SMF bx_bool dbg_crc32(bx_phy_address addr1, bx_phy_address addr2, Bit32u *crc);
 #endif
@@ -166,6 +167,8 @@ public:
 
   BX_MEM_SMF Bit64u  get_memory_len(void);
   BX_MEM_SMF void allocate_block(Bit32u index);
+  BX_MEM_SMF bx_bool map_block(Bit32u index, Bit8u *host);
+  BX_MEM_SMF bx_bool is_block_untouched(Bit32u index);
   BX_MEM_SMF Bit8u* alloc_vector_aligned(Bit64u bytes, Bit64u alignment);
 
 #if BX_SUPPORT_MONITOR_MWAIT
@@ -66,7 +66,7 @@ BX_MEM_C::BX_MEM_C()
 Bit8u* BX_MEM_C::alloc_vector_aligned(Bit64u bytes, Bit64u alignment)
 {
   Bit64u test_mask = alignment - 1;
-  BX_MEM_THIS actual_vector = new Bit8u [(Bit32u)(bytes + test_mask)];
+  BX_MEM_THIS actual_vector = new Bit8u [(size_t)(bytes + test_mask)];
   if (BX_MEM_THIS actual_vector == 0) {
     BX_PANIC(("alloc_vector_aligned: unable to allocate host RAM !"));
     return 0;
@@ -203,7 +203,9 @@ void BX_MEM_C::allocate_block(Bit32u block)
         if (BX_MEM_THIS next_swapout_idx == original_replacement_block)
           BX_PANIC(("FATAL ERROR: Insufficient working RAM, all blocks are currently used for TLB entries!"));
         buffer = BX_MEM_THIS blocks[BX_MEM_THIS next_swapout_idx];
-      } while ((!buffer) || (buffer == BX_MEM_C::swapped_out));
+        // Blocks mapped by map_block aren't in the array, they are never swapped out
+      } while ((!buffer) || (buffer == BX_MEM_C::swapped_out) ||
+               (buffer < BX_MEM_THIS vector) || (buffer >= BX_MEM_THIS vector + BX_MEM_THIS allocated));
 
       used_for_tlb = false;
       // tlb buffer check loop
@@ -249,12 +251,63 @@ void BX_MEM_C::allocate_block(Bit32u block)
 #endif
 }
 
+// Is the block only accessed through get_vector? False for the legacy area
+// below 1MB, the BIOS and the ranges with memory handlers.
+bx_bool BX_MEM_C::is_plain_ram_block(Bit32u block)
+{
+  const bx_phy_address begin = ((bx_phy_address)block) * BX_MEM_BLOCK_LEN;
+  const bx_phy_address end = begin + BX_MEM_BLOCK_LEN - 1;
+
+  if (block >= (BX_MEM_THIS len / BX_MEM_BLOCK_LEN))
+    return 0;
+
+  if (begin < 0x00100000)
+    return 0;
+
+  if (end >= (bx_phy_address)BX_MEM_THIS bios_rom_addr && begin <= BX_CONST64(0xffffffff))
+    return 0;
+
+  for (bx_phy_address page = begin >> 20; page <= (end >> 20); page++) {
+    struct memory_handler_struct *memory_handler = BX_MEM_THIS memory_handlers[page];
+    while (memory_handler) {
+      if (memory_handler->begin <= end && memory_handler->end >= begin)
+        return 0;
+      memory_handler = memory_handler->next;
+    }
+  }
+
+  return 1;
+}
+
+// Back a guest RAM block with host memory owned by the caller, instead of
+// allocating it from the memory vector. The host memory must be BX_MEM_BLOCK_LEN
+// bytes long and stay valid as long as the memory is used.
+// Only plain RAM blocks that weren't touched yet can be mapped.
+bx_bool BX_MEM_C::map_block(Bit32u block, Bit8u *host)
+{
+  if (!is_block_untouched(block))
+    return 0;
+
+  BX_MEM_THIS blocks[block] = host;
+  BX_DEBUG(("map_block: block=0x%x mapped at %p", block, host));
+  return 1;
+}
+
+// A plain RAM block that was never accessed, and so has no host memory yet
+bx_bool BX_MEM_C::is_block_untouched(Bit32u block)
+{
+  return is_plain_ram_block(block) && BX_MEM_THIS blocks[block] == NULL;
+}
+
 #if BX_LARGE_RAMFILE
 // The blocks in RAM must also be flushed to the save file.
 void ramfile_save_handler(void *devptr, FILE *fp)
 {
   for (Bit32u idx = 0; idx < (BX_MEM(0)->len / BX_MEM_BLOCK_LEN); idx++) {
-    if ((BX_MEM(0)->blocks[idx]) && (BX_MEM(0)->blocks[idx] != BX_MEM(0)->swapped_out))
+    if ((BX_MEM(0)->blocks[idx]) && (BX_MEM(0)->blocks[idx] != BX_MEM(0)->swapped_out) &&
+        // Blocks mapped by map_block aren't in the array, their owner saves them
+        (BX_MEM(0)->blocks[idx] >= BX_MEM(0)->vector) &&
+        (BX_MEM(0)->blocks[idx] < BX_MEM(0)->vector + BX_MEM(0)->allocated))
     {
       bx_phy_address address = ((bx_phy_address)idx)*BX_MEM_BLOCK_LEN;
       if (fseeko64(fp, address, SEEK_SET))
@@ -279,6 +332,10 @@ Bit64s memory_param_save_handler(void *devptr, bx_param_c *param)
     if (BX_MEM(0)->blocks[blk_index] == BX_MEM(0)->swapped_out)
       return -2;
 #endif
+    // Blocks mapped by map_block aren't in the array, their owner saves them
+    if (BX_MEM(0)->blocks[blk_index] < BX_MEM(0)->vector ||
+        BX_MEM(0)->blocks[blk_index] >= BX_MEM(0)->vector + BX_MEM(0)->allocated)
+      return -1;
     // Return the block offset into the array
     Bit32u val = (Bit32u) (BX_MEM(0)->blocks[blk_index] - BX_MEM(0)->vector);
     if ((val & (BX_MEM_BLOCK_LEN-1)) == 0)
@@ -669,7 +726,7 @@ bx_bool BX_MEM_C::dbg_fetch_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len
   return ret;
 }
 
-#if BX_DEBUGGER || BX_GDBSTUB
+#if BX_DEBUGGER || BX_GDBSTUB || BX_INSTRUMENTATION
 bx_bool BX_MEM_C::dbg_set_mem(BX_CPU_C *cpu, bx_phy_address addr, unsigned len, Bit8u *buf)
 {
   bx_phy_address a20addr = A20ADDR(addr);
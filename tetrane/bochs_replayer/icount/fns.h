@@ -4,3 +4,6 @@
 
 // Retrieve current instruction count, that is guaranteed to match reven's trace.
 uint64_t reven_icount(void);
+
+// False before the first instruction of the replay, when reven_icount can't be called
+bool reven_icount_started(void);
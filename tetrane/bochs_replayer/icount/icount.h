@@ -1,50 +1,64 @@
 #pragma once
 
+#include <cstdint>
 #include <experimental/optional>
+#include <limits>
+#include <stdexcept>
 
-extern reven::replayer::Replayer replayer;
+#include "bochs.h"
+#include "cpu/cpu.h"
 
 namespace reven {
 namespace icount {
 
+// The icount of the replay is the architectural instruction count maintained by the replayed CPU:
+// one tick per instruction (a REP instruction ticks once) and one per interrupt.
 class ICount {
 public:
 	ICount() = default;
 	explicit ICount(std::uint64_t max_icount): max_icount_(max_icount) {};
 
-	// This method should not be called when icount_ could be 0 (before the launch of the execution)
+	// This method should not be called when the count could be 0 (before the launch of the execution)
 	std::uint64_t icount() const {
-		if (icount_ == 0)
+		if (!started())
 			throw std::logic_error("Call to icount before initialization.");
-		return icount_ - 1;
+		return BX_CPU(cpu_.value())->get_arch_icount() - 1;
 	}
 
-	void before_instruction() {
-		check_max_icount();
-		++icount_;
+	bool started() const {
+		return cpu_ and BX_CPU(cpu_.value())->get_arch_icount() != 0;
 	}
 
-	void break_and_start_new_instruction() {
-		check_max_icount();
-		++icount_;
+	// Count from the start of the scenario on the CPU `cpu`
+	void reset(unsigned cpu) {
+		start_at(cpu, 0);
+	}
+
+	// Continue the count on the CPU `cpu` after the instruction `icount`, when resuming from a checkpoint
+	void resume_after(unsigned cpu, std::uint64_t icount) {
+		start_at(cpu, icount + 1);
 	}
 
 private:
 
-	void check_max_icount() {
-		/* multiple necessary checks before ending the replay:
-		 *  * replay is started
-		 *  * there is a max_icount specified for the replay
-		 *  * the max_icount has been reached
-		 * then we can end the replay
-		 */
-		if (icount_ != 0 && max_icount_ && icount() > max_icount_.value()) {
-			::replayer.end_of_scenario(0, false);
-		}
+	void start_at(unsigned cpu, std::uint64_t count) {
+		cpu_ = cpu;
+		BX_CPU(cpu)->set_arch_icount(count);
+		BX_CPU(cpu)->set_icount_target(max_icount_ ? icount_target(max_icount_.value()) : 0);
+	}
+
+	// The replay ends with icount() at max_icount + 1, before the instruction or interrupt following it starts.
+	// The CPU checks the target against its count before counting the next one, and the count is icount() + 1.
+	static std::uint64_t icount_target(std::uint64_t max_icount) {
+		// Past the end of the count, no target
+		if (max_icount > std::numeric_limits<std::uint64_t>::max() - 2)
+			return 0;
+
+		return max_icount + 2;
 	}
 
-	std::uint64_t icount_ = 0; // The next instruction tick
 	std::experimental::optional<std::uint64_t> max_icount_; // The number of instructions to replay. If not set, means replay all instructions
+	std::experimental::optional<unsigned> cpu_; // The replayed CPU, set when the count starts
 };
 
 }
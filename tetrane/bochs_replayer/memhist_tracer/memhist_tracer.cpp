@@ -1,12 +1,23 @@
 #include "memhist_tracer.h"
 
 #include "tetrane/bochs_replayer/icount/fns.h"
+#include "tetrane/bochs_replayer/util/telemetry.h"
 
 #include "bxversion.h"
 
 namespace reven {
 namespace memhist_tracer {
 
+namespace {
+
+constexpr std::size_t batch_size = 16384;
+constexpr std::size_t max_pending_batches = 16;
+
+// Don't let a merged access cross a page
+constexpr std::uint64_t page_size = 4096;
+
+}
+
 MemhistTracer::MemhistTracer(const std::string& trace_file) {
 	const char* tool_name = "bochs_replayer";
 	const char* tool_version = "1.2.0";
@@ -23,30 +34,119 @@ MemhistTracer::MemhistTracer(const std::string& trace_file) {
 
 	std::remove(trace_file.c_str());
 	memory_history_writer_.emplace(trace_file.c_str(), tool_name, tool_version, tool_info);
+
+	batch_.reserve(batch_size);
+	thread_ = std::thread(&MemhistTracer::write_thread, this);
+}
+
+MemhistTracer::~MemhistTracer() {
+	end();
 }
 
 void MemhistTracer::end() {
+	if (not thread_.joinable())
+		return;
+
+	flush_pending();
+	submit_batch();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+
 	if (memory_history_writer_) {
 		memory_history_writer_->discard_after(reven_icount());
 		memory_history_writer_ = std::experimental::nullopt;
 	}
 }
 
-void MemhistTracer::linear_memory_access(std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* /* data */, bool /* read */, bool write, bool execute) {
+void MemhistTracer::push(const MemoryAccess& access) {
+	if (pending_) {
+		auto& pending = *pending_;
+
+		if (pending.transition_id == access.transition_id and pending.operation == access.operation
+		    and pending.is_virtual == access.is_virtual
+		    and pending.physical_address + pending.size == access.physical_address
+		    and (not access.is_virtual or pending.linear_address + pending.size == access.linear_address)
+		    and pending.physical_address / page_size == (access.physical_address + access.size - 1) / page_size) {
+			pending.size += access.size;
+			return;
+		}
+
+		flush_pending();
+	}
+
+	pending_ = access;
+}
+
+void MemhistTracer::flush_pending() {
+	if (not pending_)
+		return;
+
+	batch_.push_back(*pending_);
+	pending_ = std::experimental::nullopt;
+	++util::telemetry.memhist_records;
+
+	if (batch_.size() >= batch_size)
+		submit_batch();
+}
+
+void MemhistTracer::submit_batch() {
+	if (batch_.empty())
+		return;
+
+	std::vector<MemoryAccess> batch;
+	batch.reserve(batch_size);
+	std::swap(batch, batch_);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	cv_.wait(lock, [this] { return batches_.size() < max_pending_batches; });
+	batches_.push_back(std::move(batch));
+	lock.unlock();
+
+	cv_.notify_all();
+}
+
+void MemhistTracer::write_thread() {
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (true) {
+		cv_.wait(lock, [this] { return stop_ or not batches_.empty(); });
+
+		if (batches_.empty())
+			return;
+
+		auto batch = std::move(batches_.front());
+		batches_.pop_front();
+		lock.unlock();
+		cv_.notify_all();
+
+		for (const auto& access : batch) {
+			memory_history_writer_->push(access);
+		}
+
+		lock.lock();
+	}
+}
+
+void MemhistTracer::linear_memory_access(unsigned /* cpu */, std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* /* data */, bool /* read */, bool write, bool execute) {
 	if (execute) {
 		return;
 	}
 
-	memory_history_writer_->push({reven_icount(), physical_address, linear_address, static_cast<std::uint32_t>(len), true, write ? reven::backend::memaccess::db::Operation::Write : reven::backend::memaccess::db::Operation::Read});
+	push({reven_icount(), physical_address, linear_address, static_cast<std::uint32_t>(len), true, write ? reven::backend::memaccess::db::Operation::Write : reven::backend::memaccess::db::Operation::Read});
 }
 
-void MemhistTracer::physical_memory_access(std::uint64_t /* address */, std::size_t /* len */, const std::uint8_t* /* data */, bool /* read */, bool /* write */ , bool /* execute */) {
+void MemhistTracer::physical_memory_access(unsigned /* cpu */, std::uint64_t /* address */, std::size_t /* len */, const std::uint8_t* /* data */, bool /* read */, bool /* write */ , bool /* execute */) {
 	// Physical access are mainly done by the MMU
 	// We don't want to keep MMU accesses, because they have a huge impact on the database's size.
 }
 
 void MemhistTracer::device_physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* /* data */, bool /* read */, bool write) {
-	memory_history_writer_->push({reven_icount(), address, 0, static_cast<std::uint32_t>(len), false, write ? reven::backend::memaccess::db::Operation::Write : reven::backend::memaccess::db::Operation::Read});
+	push({reven_icount(), address, 0, static_cast<std::uint32_t>(len), false, write ? reven::backend::memaccess::db::Operation::Write : reven::backend::memaccess::db::Operation::Read});
 }
 
 }
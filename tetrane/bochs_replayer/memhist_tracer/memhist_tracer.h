@@ -1,6 +1,11 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <experimental/optional>
 
 #include <rvnmemhistwriter/db_writer.h>
@@ -8,18 +13,38 @@
 namespace reven {
 namespace memhist_tracer {
 
+// Adjacent accesses of the same instruction and operation are merged into a single range before being pushed.
+// The accesses are then handed in batches to a background thread that feeds the database.
 class MemhistTracer {
 public:
 	MemhistTracer(const std::string& trace_file);
+	~MemhistTracer();
 
 	void end();
 
-	void linear_memory_access(std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
-	void physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
+	void linear_memory_access(unsigned cpu, std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
+	void physical_memory_access(unsigned cpu, std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
 	void device_physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write);
 
 private:
+	using MemoryAccess = reven::backend::memaccess::db::MemoryAccess;
+
+	void push(const MemoryAccess& access);
+	void flush_pending();
+	void submit_batch();
+	void write_thread();
+
 	std::experimental::optional<reven::backend::memaccess::db::DbWriter> memory_history_writer_;
+
+	std::experimental::optional<MemoryAccess> pending_;
+	std::vector<MemoryAccess> batch_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::vector<MemoryAccess>> batches_;
+	bool stop_{false};
+
+	std::thread thread_;
 };
 
 }
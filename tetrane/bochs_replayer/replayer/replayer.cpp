@@ -1,77 +1,151 @@
 #include "replayer.h"
 
-#include <iostream>
 #include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <experimental/optional>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "iodev/iodev.h"
 #include "cpu/decoder/ia_opcodes.h"
 
 #include "util/log.h"
+#include "util/telemetry.h"
 #include "tetrane/bochs_replayer/icount/fns.h"
 
 namespace reven {
 namespace replayer {
 
 namespace {
-	// Instructions where we need a sync point
-	const std::vector<BxExecutePtr_tR> emulated_instructions{
-		&BX_CPU_C::INSB32_YbDX,
-		&BX_CPU_C::INSB16_YbDX,
-		&BX_CPU_C::INSW32_YwDX,
-		&BX_CPU_C::INSW16_YwDX,
-		&BX_CPU_C::INSD32_YdDX,
-		&BX_CPU_C::INSD16_YdDX,
-		&BX_CPU_C::OUTSB32_DXXb,
-		&BX_CPU_C::OUTSB16_DXXb,
-		&BX_CPU_C::OUTSW32_DXXw,
-		&BX_CPU_C::OUTSW16_DXXw,
-		&BX_CPU_C::OUTSD32_DXXd,
-		&BX_CPU_C::OUTSD16_DXXd,
-
-		&BX_CPU_C::REP_INSB_YbDX,
-		&BX_CPU_C::REP_INSW_YwDX,
-		&BX_CPU_C::REP_INSD_YdDX,
-		&BX_CPU_C::REP_OUTSB_DXXb,
-		&BX_CPU_C::REP_OUTSW_DXXw,
-		&BX_CPU_C::REP_OUTSD_DXXd,
-
-		&BX_CPU_C::INSB64_YbDX,
-		&BX_CPU_C::INSW64_YwDX,
-		&BX_CPU_C::INSD64_YdDX,
-
-		&BX_CPU_C::OUTSB64_DXXb,
-		&BX_CPU_C::OUTSW64_DXXw,
-		&BX_CPU_C::OUTSD64_DXXd,
-
-		&BX_CPU_C::IN_ALIb,
-		&BX_CPU_C::IN_AXIb,
-		&BX_CPU_C::IN_EAXIb,
-		&BX_CPU_C::OUT_IbAL,
-		&BX_CPU_C::OUT_IbAX,
-		&BX_CPU_C::OUT_IbEAX,
-
-		&BX_CPU_C::IN_ALDX,
-		&BX_CPU_C::IN_AXDX,
-		&BX_CPU_C::IN_EAXDX,
-		&BX_CPU_C::OUT_DXAL,
-		&BX_CPU_C::OUT_DXAX,
-		&BX_CPU_C::OUT_DXEAX,
-
-		&BX_CPU_C::RDTSC,
-		&BX_CPU_C::RDMSR,
-		&BX_CPU_C::WRMSR,
-
-		&BX_CPU_C::MONITOR,
-		&BX_CPU_C::MWAIT,
-
-		&BX_CPU_C::HLT,
-	};
+	// VirtualBox puts the RAM at 0 up to the PCI hole, and relocates the rest of the RAM at 4GB
+	constexpr std::uint64_t ram_above_4g_start = 0x100000000;
+
+	const char checkpoint_magic[8] = {'R', 'V', 'N', 'C', 'K', 'P', 'T', '1'};
+	const char* checkpoint_state_file = "/replayer.checkpoint";
+
+	template <typename T>
+	void write_value(std::ostream& out, const T& value) {
+		out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	template <typename T>
+	bool read_value(std::istream& in, T& value) {
+		return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+	}
+
+	// Offsets of the pages written in a private file mapping. These pages became anonymous copies of the file,
+	// which the kernel tells in the page table. If it can't be read, every page is considered written.
+	std::vector<std::uint64_t> written_pages(const void* address, std::size_t size, std::uint64_t page_size) {
+		const std::uint64_t first_page = reinterpret_cast<std::uintptr_t>(address) / page_size;
+		const std::uint64_t page_count = (size + page_size - 1) / page_size;
+
+		std::vector<std::uint64_t> pages;
+
+		int fd = ::open("/proc/self/pagemap", O_RDONLY);
+		if (fd < 0) {
+			for (std::uint64_t page = 0; page < page_count; ++page) {
+				pages.push_back(page * page_size);
+			}
+			return pages;
+		}
+
+		std::vector<std::uint64_t> entries(4096);
+
+		for (std::uint64_t page = 0; page < page_count; page += entries.size()) {
+			const std::size_t count = std::min<std::uint64_t>(entries.size(), page_count - page);
+			const ssize_t bytes = ::pread(fd, entries.data(), count * sizeof(std::uint64_t), (first_page + page) * sizeof(std::uint64_t));
+
+			for (std::size_t i = 0; i < count; ++i) {
+				const std::uint64_t entry = bytes == static_cast<ssize_t>(count * sizeof(std::uint64_t)) ? entries[i] : ~0ull;
+				const bool present = entry & (1ull << 63);
+				const bool swapped = entry & (1ull << 62);
+				const bool file_page = entry & (1ull << 61);
+
+				if (swapped or (present and not file_page)) {
+					pages.push_back((page + i) * page_size);
+				}
+			}
+		}
+
+		::close(fd);
+		return pages;
+	}
+
+	// The files are read sequentially during the whole replay: ask the kernel to read them ahead
+	void prefetch_file(const std::string& filename) {
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		::close(fd);
+	}
+
+	static std::bitset<BX_IA_LAST> opcode_set(std::initializer_list<Bit16u> opcodes) {
+		std::bitset<BX_IA_LAST> set;
+
+		for (auto opcode : opcodes) {
+			set.set(opcode);
+		}
+
+		return set;
+	}
+
+	// Instructions where we need a sync point, indexed by opcode so they can be tested on each instruction
+	// The non-REP INS/OUTS are decoded with the REP_ opcodes too
+	const std::bitset<BX_IA_LAST> emulated_instructions = opcode_set({
+		BX_IA_REP_INSB_YbDX,
+		BX_IA_REP_INSW_YwDX,
+		BX_IA_REP_INSD_YdDX,
+		BX_IA_REP_OUTSB_DXXb,
+		BX_IA_REP_OUTSW_DXXw,
+		BX_IA_REP_OUTSD_DXXd,
+
+		BX_IA_IN_ALIb,
+		BX_IA_IN_AXIb,
+		BX_IA_IN_EAXIb,
+		BX_IA_OUT_IbAL,
+		BX_IA_OUT_IbAX,
+		BX_IA_OUT_IbEAX,
+
+		BX_IA_IN_ALDX,
+		BX_IA_IN_AXDX,
+		BX_IA_IN_EAXDX,
+		BX_IA_OUT_DXAL,
+		BX_IA_OUT_DXAX,
+		BX_IA_OUT_DXEAX,
+
+		BX_IA_RDTSC,
+		BX_IA_RDMSR,
+		BX_IA_WRMSR,
+
+		BX_IA_MONITOR,
+		BX_IA_MWAIT,
+		BX_IA_MONITORX,
+		BX_IA_MWAITX,
+
+		BX_IA_HLT,
+	});
 
 	// Instructions that we don't want to nop to let bochs execute them
-	const std::vector<BxExecutePtr_tR> executed_instructions{
+	const std::bitset<BX_IA_LAST> executed_instructions = opcode_set({
 		// We don't want to skip WRMSR because it's important for bochs to know the value of some MSRs (FS_BASE for example)
-		&BX_CPU_C::WRMSR,
-	};
+		BX_IA_WRMSR,
+	});
 
 	static bool looks_like_eflags(std::uint32_t value)
 	{
@@ -114,6 +188,43 @@ namespace {
 		return valid;
 	}
 
+	// Names of the registers of `current` that differ from the `expected` context of a sync point
+	static std::string differing_registers(const reven::vmghost::sync_event::context& current, const reven::vmghost::sync_event::context& expected) {
+		std::string names;
+
+	#define TEST_REGISTER(name) \
+		if (current.name != expected.name) \
+			names += (names.empty() ? "" : ", ") + std::string(#name);
+
+		TEST_REGISTER(rax);
+		TEST_REGISTER(rbx);
+		TEST_REGISTER(rcx);
+		TEST_REGISTER(rdx);
+		TEST_REGISTER(rsi);
+		TEST_REGISTER(rdi);
+		TEST_REGISTER(rbp);
+		TEST_REGISTER(rsp);
+		TEST_REGISTER(r8);
+		TEST_REGISTER(r9);
+		TEST_REGISTER(r10);
+		TEST_REGISTER(r11);
+		TEST_REGISTER(r12);
+		TEST_REGISTER(r13);
+		TEST_REGISTER(r14);
+		TEST_REGISTER(r15);
+		TEST_REGISTER(cr0);
+		TEST_REGISTER(cr2);
+		TEST_REGISTER(cr3);
+		TEST_REGISTER(cr4);
+		TEST_REGISTER(fpu_sw);
+		TEST_REGISTER(fpu_cw);
+		TEST_REGISTER(fpu_tags);
+
+	#undef TEST_REGISTER
+
+		return names;
+	}
+
 	static bool exception_do_have_error_code(std::uint8_t vector) {
 		if (vector == 8 // Double fault
 			|| vector == 10 // Invalid TSS
@@ -134,13 +245,19 @@ Replayer::Replayer() {}
 
 Replayer::~Replayer() {
 	for (auto& range : ranges_) {
-		delete [] range.memory;
+		std::free(range.memory);
 	}
 
 	ranges_.clear();
+
+	for (const auto& mapping : mappings_) {
+		::munmap(mapping.address, mapping.size);
+	}
 }
 
 bool Replayer::load(const std::string& core_file, const std::string& analyze_dir) {
+	core_file_ = core_file;
+
 	try {
 		core_.parse(core_file);
 	} catch(const std::exception& e) {
@@ -148,18 +265,50 @@ bool Replayer::load(const std::string& core_file, const std::string& analyze_dir
 		return false;
 	}
 
+	// The sync points and hardware accesses aren't attached to a CPU in the recording,
+	// so there is no way to replay the interleaving of several CPUs deterministically.
 	if (core_.cpu_count() != 1) {
-		LOG_FATAL_ERROR("Core file should have only 1 core for now")
+		LOG_FATAL_ERROR("Core file should have only 1 core, got " << core_.cpu_count())
 		return false;
 	}
 
+	// The core file doesn't tell the RAM from the memory of the devices, so follow the RAM layout of VirtualBox:
+	// the chunk at 0 is the RAM below the PCI hole, the devices are mapped in the hole.
+	// Only when this RAM reaches the hole, the rest of the RAM is the chunk at 4GB,
+	// otherwise a chunk there is a device (e.g. a 64-bit PCI BAR), as is any other chunk above 4GB.
+	std::experimental::optional<RamRange> ram_below_4g;
+	std::experimental::optional<RamRange> chunk_at_4g;
+	std::uint64_t pci_hole_start = ram_above_4g_start;
+
+	core_.physical_memory()->visit_chunks([&](const reven::vmghost::MemoryChunk& chunk) {
+		if (chunk.physical_address() == 0) {
+			ram_below_4g = RamRange{chunk.physical_address(), chunk.size_in_memory()};
+		} else if (chunk.physical_address() == ram_above_4g_start) {
+			chunk_at_4g = RamRange{chunk.physical_address(), chunk.size_in_memory()};
+		} else if (chunk.physical_address() < ram_above_4g_start) {
+			pci_hole_start = std::min(pci_hole_start, chunk.physical_address());
+		}
+	});
+
+	if (ram_below_4g) {
+		ram_ranges_.push_back(*ram_below_4g);
+
+		if (chunk_at_4g and ram_below_4g->size == pci_hole_start) {
+			ram_ranges_.push_back(*chunk_at_4g);
+		}
+	}
+
+	prefetch_file(analyze_dir + "/sync_point.bin");
+	prefetch_file(analyze_dir + "/sync_point_data.bin");
+	prefetch_file(analyze_dir + "/hardware.bin");
+
 	try {
 		if (!sync_file_.load(analyze_dir + "/sync_point.bin", analyze_dir + "/sync_point_data.bin")) {
 			LOG_FATAL_ERROR("Can't open the sync file")
 			return false;
 		}
 
-		sync_file_.next();
+		next_sync_event();
 	} catch(const std::runtime_error& e) {
 		LOG_FATAL_ERROR("Error while loading the sync file: " << e.what());
 		return false;
@@ -171,7 +320,7 @@ bool Replayer::load(const std::string& core_file, const std::string& analyze_dir
 			return false;
 		}
 
-		hardware_file_.next();
+		next_hardware_access();
 	} catch(const std::runtime_error& e) {
 		LOG_FATAL_ERROR("Error while loading the hardware file: " << e.what());
 		return false;
@@ -190,40 +339,54 @@ static bx_bool memory_write_handler(bx_phy_address addr, unsigned len, void *dat
 	return true;
 }
 
+// Let the CPU access the memory of the devices through its TLB instead of calling the handlers
+static Bit8u* memory_direct_access_handler(bx_phy_address addr, unsigned /* rw */, void *param) {
+	return static_cast<Replayer*>(param)->device_memory_pointer(addr);
+}
 
-bool Replayer::reset(unsigned cpu) {
-	BX_MEM(0)->enable_smram(true, true);
 
-	// Write the memory
+void Replayer::register_device_memory() {
 	core_.physical_memory()->visit_chunks([&](const reven::vmghost::MemoryChunk& chunk) {
 		// Is the RAM from a device?
-		if (chunk.physical_address() != 0) {
+		if (not is_ram_chunk(chunk)) {
+			// Page aligned, as the CPU TLB can access it directly (see memory_direct_access_handler)
+			void* memory = nullptr;
+			if (posix_memalign(&memory, 0x1000, chunk.size_in_memory()) != 0) {
+				throw std::bad_alloc();
+			}
+
 			ranges_.push_back({
 				chunk.physical_address(),
 				chunk.size_in_memory(),
-				new std::uint8_t[chunk.size_in_memory()]
+				static_cast<std::uint8_t*>(memory)
 			});
 
 			chunk.read(chunk.physical_address(), ranges_.back().memory, chunk.size_in_memory());
 
 			BX_MEM(0)->unregisterMemoryHandlers(NULL, chunk.physical_address(), chunk.physical_address() + chunk.size_in_memory() - 1);
-			if (!BX_MEM(0)->registerMemoryHandlers(this, memory_read_handler, memory_write_handler, /* memory_direct_access_handler_t da_handler */ NULL,
+			if (!BX_MEM(0)->registerMemoryHandlers(this, memory_read_handler, memory_write_handler, memory_direct_access_handler,
 			    chunk.physical_address(), chunk.physical_address() + chunk.size_in_memory() - 1)) {
 				LOG_ERROR("Can't register memory handler");
 			}
-
-			return;
 		}
+	});
+
+	std::sort(ranges_.begin(), ranges_.end(), [](const MemoryRange& a, const MemoryRange& b) {
+		return a.start_address < b.start_address;
+	});
+}
 
-		std::uint8_t* buffer = new std::uint8_t[chunk.size_in_memory()];
-		chunk.read(chunk.physical_address(), buffer, chunk.size_in_memory());
+bool Replayer::reset(unsigned cpu) {
+	BX_MEM(0)->enable_smram(true, true);
 
-		// dbg_set_mem won't modify the content of the buffer even if taking a non-const value
-		if (!BX_MEM(0)->dbg_set_mem(BX_CPU(cpu), chunk.physical_address(), chunk.size_in_memory(), const_cast<Bit8u*>(reinterpret_cast<const Bit8u*>(buffer)))) {
-			LOG_ERROR("Can't write memory of size " << chunk.size_in_memory() << " at " << std::showbase << std::hex << chunk.physical_address())
-		}
+	// Register the memory of the devices first, so their ranges are never mapped as RAM
+	register_device_memory();
 
-		delete [] buffer;
+	// Write the memory
+	core_.physical_memory()->visit_chunks([&](const reven::vmghost::MemoryChunk& chunk) {
+		if (is_ram_chunk(chunk)) {
+			load_ram_chunk(cpu, chunk, false);
+		}
 	});
 
 	// Copy the memory from 0xE0000000 to 0xB8000
@@ -536,32 +699,30 @@ bool Replayer::is_final_int3(unsigned cpu, const bxInstruction_c *i) const {
 	return i->getIaOpcode() == BX_IA_INT3 && BX_CPU(cpu)->gen_reg[2].rrx == 0xdeadbabe && BX_CPU(cpu)->gen_reg[0].rrx == 0xeff1cad1;
 }
 
-void Replayer::before_instruction(unsigned cpu, bxInstruction_c *i) {
-	// Reset the current event
-	current_event_ = reven::vmghost::sync_event();
-
-	// We need to save i->execute1 and restore it later if we change it to not break the iCache
-	current_instruction_ = i->execute1;
-	current_rip_ = BX_CPU(cpu)->gen_reg[BX_64BIT_REG_RIP].rrx;
-
-	// If we match the previous registered interrupt event, we launch an interrupt
-	if (saved_interrupt_event_.is_valid && current_rip_ == saved_interrupt_event_.interrupt_rip) {
-		apply_hardware_access(cpu, saved_interrupt_event_.start_context.tsc);
+bool Replayer::is_trace_instrumented(const bxInstruction_c *i, unsigned len) const {
+	// These instructions are handled in before_instruction whatever the sync points
+	for (unsigned index = 0; index < len; ++index) {
+		if (emulated_instructions[i[index].getIaOpcode()] or i[index].getIaOpcode() == BX_IA_INT3)
+			return true;
+	}
 
-		LOG_WARN("Simulating an interrupt for Sync Event $" << std::dec << saved_interrupt_event_.position)
-		BX_CPU(cpu)->interrupt(saved_interrupt_event_.interrupt_vector, BX_EXTERNAL_INTERRUPT, 0, saved_interrupt_event_.fault_error_code);
+	return false;
+}
 
-		saved_interrupt_event_ = reven::vmghost::sync_event();
-		longjmp(BX_CPU(cpu)->jmp_buf_env, 0);
-	}
+bool Replayer::is_trace_needed(unsigned cpu, unsigned len) const {
+	// An event is waiting for before_instruction to be reset, applied or to end the replay
+	if (current_event_.is_valid or !next_event_.is_valid or next_event_.is_first_event_context_unknown)
+		return true;
 
-	auto sync_event = sync_file_.current_event();
+	// The trace is entered at its first instruction, but can be left before its end
+	std::uint64_t rip = BX_CPU(cpu)->gen_reg[BX_64BIT_REG_RIP].rrx;
+	if (next_event_.start_rip - rip < len)
+		return true;
 
-	// The event is invalid, so it's the end
-	if (!sync_event.is_valid) {
-		LOG_END_REPLAY(cpu, "No more valid sync points")
-	}
+	return saved_interrupt_event_.is_valid and saved_interrupt_event_.interrupt_rip - rip < len;
+}
 
+void Replayer::update_current_context(unsigned cpu) {
 	current_ctx_.rax = BX_CPU(cpu)->gen_reg[0].rrx;
 	current_ctx_.rbx = BX_CPU(cpu)->gen_reg[3].rrx;
 	current_ctx_.rcx = BX_CPU(cpu)->gen_reg[1].rrx;
@@ -585,26 +746,66 @@ void Replayer::before_instruction(unsigned cpu, bxInstruction_c *i) {
 	current_ctx_.fpu_sw = BX_CPU(cpu)->the_i387.get_status_word();
 	current_ctx_.fpu_cw = BX_CPU(cpu)->the_i387.get_control_word();
 	current_ctx_.fpu_tags = BX_CPU(cpu)->pack_FPU_TW(BX_CPU(cpu)->the_i387.get_tag_word());
+}
+
+void Replayer::match_sync_event(const reven::vmghost::sync_event& sync_event) {
+	current_event_ = sync_event;
+	last_sync_point_ = current_event_.position;
+	++util::telemetry.sync_points;
+
+	next_sync_event();
+}
+
+void Replayer::next_sync_event() {
+	sync_file_.next();
+	++sync_events_read_;
+	next_event_ = sync_file_.current_event();
+}
+
+void Replayer::before_instruction(unsigned cpu, bxInstruction_c *i) {
+	// Reset the current event
+	if (current_event_.is_valid)
+		current_event_ = reven::vmghost::sync_event();
+
+	// We need to save i->execute1 and restore it later if we change it to not break the iCache
+	current_instruction_ = i->execute1;
+	current_rip_ = BX_CPU(cpu)->gen_reg[BX_64BIT_REG_RIP].rrx;
+
+	// If we match the previous registered interrupt event, we launch an interrupt
+	if (saved_interrupt_event_.is_valid && current_rip_ == saved_interrupt_event_.interrupt_rip) {
+		apply_hardware_access(cpu, saved_interrupt_event_.start_context.tsc);
+
+		LOG_WARN("Simulating an interrupt for Sync Event $" << std::dec << saved_interrupt_event_.position)
+		BX_CPU(cpu)->interrupt(saved_interrupt_event_.interrupt_vector, BX_EXTERNAL_INTERRUPT, 0, saved_interrupt_event_.fault_error_code);
+
+		saved_interrupt_event_ = reven::vmghost::sync_event();
+		longjmp(BX_CPU(cpu)->jmp_buf_env, 0);
+	}
+
+	auto& sync_event = next_event_;
+
+	// The event is invalid, so it's the end
+	if (!sync_event.is_valid) {
+		LOG_END_REPLAY(cpu, "No more valid sync points")
+	}
 
 	// The first event is always applied at the beginning
 	if (sync_event.is_first_event_context_unknown) {
-		current_event_ = sync_event;
-		last_sync_point_ = current_event_.position;
-		sync_file_.next();
+		match_sync_event(sync_event);
 
 		LOG_MATCH_SYNC_EVENT(cpu, current_event_, sync_file_.sync_point_count(), begin_time_)
-		apply_sync_event(cpu, sync_event);
+		apply_sync_event(cpu, current_event_);
 	} else if (current_rip_ == sync_event.start_rip) {
+		// The context is only needed to match the event, don't snapshot it on every instruction
+		update_current_context(cpu);
+
 		if (sync_event.start_context.are_values_equivalent(current_ctx_)) {
-			current_event_ = sync_event;
-			last_sync_point_ = current_event_.position;
-			sync_file_.next();
+			match_sync_event(sync_event);
 
 			LOG_MATCH_SYNC_EVENT(cpu, current_event_, sync_file_.sync_point_count(), begin_time_)
 		} else if (!sync_event.has_interrupt && match_with_no_eflags(current_ctx_, sync_event.start_context)) {
-			current_event_ = sync_event;
-			last_sync_point_ = current_event_.position;
-			sync_file_.next();
+			match_sync_event(sync_event);
+			record_divergence(cpu, "matched without EFLAGS, differing " + differing_registers(current_ctx_, current_event_.start_context));
 
 			LOG_MATCH_SYNC_EVENT_EXTRA(cpu, current_event_, sync_file_.sync_point_count(), begin_time_, " without EFLAGS !")
 		}
@@ -627,8 +828,7 @@ void Replayer::before_instruction(unsigned cpu, bxInstruction_c *i) {
 		// We don't nop the instruction if it's the first, if we really need to nop it we will do it at the end of the function
 		if (!current_event_.is_first_event_context_unknown && current_event_.is_instruction_emulation) {
 			// We don't want to nop some instructions like WRMSR
-			if (std::find(executed_instructions.cbegin(), executed_instructions.cend(), i->execute1) == executed_instructions.cend()
-				&& std::find(emulated_instructions.cbegin(), emulated_instructions.cend(), i->execute1) != emulated_instructions.cend()) {
+			if (!executed_instructions[i->getIaOpcode()] && emulated_instructions[i->getIaOpcode()]) {
 				i->execute1 = &BX_CPU_C::NOP;
 			}
 		}
@@ -662,14 +862,14 @@ void Replayer::before_instruction(unsigned cpu, bxInstruction_c *i) {
 	}
 
 	// If we know we don't handle the instruction, we can just nop it
-	if (std::find(emulated_instructions.cbegin(), emulated_instructions.cend(), i->execute1) != emulated_instructions.cend()) {
+	if (emulated_instructions[i->getIaOpcode()]) {
 		if (!current_event_.is_valid) {
 			LOG_DESYNC_SYNC_EVENT(cpu, sync_event)
 			LOG_DESYNC(cpu, "We can't execute this instruction without a sync_point")
 		}
 
 		// We don't want to nop some instructions like WRMSR
-		if (std::find(executed_instructions.cbegin(), executed_instructions.cend(), i->execute1) == executed_instructions.cend()) {
+		if (!executed_instructions[i->getIaOpcode()]) {
 			i->execute1 = &BX_CPU_C::NOP;
 		}
 	}
@@ -692,37 +892,23 @@ void Replayer::after_instruction(unsigned cpu, bxInstruction_c *i) {
 			apply_sync_event(cpu, current_event_);
 
 		current_event_ = reven::vmghost::sync_event();
+
+		// Only checkpoint once the instruction is complete (not between two REP iterations)
+		// and without an interrupt waiting for its RIP
+		if (checkpoint_frequency_ != 0 and ++sync_points_since_checkpoint_ >= checkpoint_frequency_
+		    and !saved_interrupt_event_.is_valid and BX_CPU(cpu)->gen_reg[BX_64BIT_REG_RIP].rrx != current_rip_) {
+			save_checkpoint(cpu);
+			sync_points_since_checkpoint_ = 0;
+		}
 	}
 }
 
 void Replayer::exception(unsigned cpu, unsigned vector, unsigned error_code) {
-	auto sync_event = sync_file_.current_event();
+	auto& sync_event = next_event_;
 
 	// When we are having a code pagefault we didn't match the sync event in before_instruction so we need to match it now
 	if (!current_event_.is_valid) {
-		current_ctx_.rax = BX_CPU(cpu)->gen_reg[0].rrx;
-		current_ctx_.rbx = BX_CPU(cpu)->gen_reg[3].rrx;
-		current_ctx_.rcx = BX_CPU(cpu)->gen_reg[1].rrx;
-		current_ctx_.rdx = BX_CPU(cpu)->gen_reg[2].rrx;
-		current_ctx_.rsi = BX_CPU(cpu)->gen_reg[6].rrx;
-		current_ctx_.rdi = BX_CPU(cpu)->gen_reg[7].rrx;
-		current_ctx_.rbp = BX_CPU(cpu)->gen_reg[5].rrx;
-		current_ctx_.rsp = BX_CPU(cpu)->gen_reg[4].rrx;
-		current_ctx_.r8 = BX_CPU(cpu)->gen_reg[8].rrx;
-		current_ctx_.r9 = BX_CPU(cpu)->gen_reg[9].rrx;
-		current_ctx_.r10 = BX_CPU(cpu)->gen_reg[10].rrx;
-		current_ctx_.r11 = BX_CPU(cpu)->gen_reg[11].rrx;
-		current_ctx_.r12 = BX_CPU(cpu)->gen_reg[12].rrx;
-		current_ctx_.r13 = BX_CPU(cpu)->gen_reg[13].rrx;
-		current_ctx_.r14 = BX_CPU(cpu)->gen_reg[14].rrx;
-		current_ctx_.r15 = BX_CPU(cpu)->gen_reg[15].rrx;
-		current_ctx_.cr0 = BX_CPU(cpu)->cr0.val32;
-		current_ctx_.cr2 = BX_CPU(cpu)->cr2;
-		current_ctx_.cr3 = BX_CPU(cpu)->cr3;
-		current_ctx_.cr4 = BX_CPU(cpu)->cr4.val32;
-		current_ctx_.fpu_sw = BX_CPU(cpu)->the_i387.get_status_word();
-		current_ctx_.fpu_cw = BX_CPU(cpu)->the_i387.get_control_word();
-		current_ctx_.fpu_tags = BX_CPU(cpu)->pack_FPU_TW(BX_CPU(cpu)->the_i387.get_tag_word());
+		update_current_context(cpu);
 
 		// The event is invalid, so it's the end
 		if (!sync_event.is_valid) {
@@ -731,15 +917,12 @@ void Replayer::exception(unsigned cpu, unsigned vector, unsigned error_code) {
 
 		if (BX_CPU(cpu)->prev_rip == sync_event.interrupt_rip) {
 			if (sync_event.start_context.are_values_equivalent(current_ctx_)) {
-				current_event_ = sync_event;
-				last_sync_point_ = current_event_.position;
-				sync_file_.next();
+				match_sync_event(sync_event);
 
 				LOG_MATCH_SYNC_EVENT_EXTRA(cpu, current_event_, sync_file_.sync_point_count(), begin_time_, " during an exception")
 			} else if (match_with_no_eflags(current_ctx_, sync_event.start_context)) {
-				current_event_ = sync_event;
-				last_sync_point_ = current_event_.position;
-				sync_file_.next();
+				match_sync_event(sync_event);
+				record_divergence(cpu, "matched during an exception without EFLAGS, differing " + differing_registers(current_ctx_, current_event_.start_context));
 
 				LOG_MATCH_SYNC_EVENT_EXTRA(cpu, current_event_, sync_file_.sync_point_count(), begin_time_, " during an exception without EFLAGS !")
 			}
@@ -760,31 +943,9 @@ void Replayer::exception(unsigned cpu, unsigned vector, unsigned error_code) {
 void Replayer::interrupt(unsigned cpu, unsigned vector) {
 	// When we are having an APIC interrupt we didn't match the sync event in before_instruction so we need to match it now
 	if (!current_event_.is_valid) {
-		current_ctx_.rax = BX_CPU(cpu)->gen_reg[0].rrx;
-		current_ctx_.rbx = BX_CPU(cpu)->gen_reg[3].rrx;
-		current_ctx_.rcx = BX_CPU(cpu)->gen_reg[1].rrx;
-		current_ctx_.rdx = BX_CPU(cpu)->gen_reg[2].rrx;
-		current_ctx_.rsi = BX_CPU(cpu)->gen_reg[6].rrx;
-		current_ctx_.rdi = BX_CPU(cpu)->gen_reg[7].rrx;
-		current_ctx_.rbp = BX_CPU(cpu)->gen_reg[5].rrx;
-		current_ctx_.rsp = BX_CPU(cpu)->gen_reg[4].rrx;
-		current_ctx_.r8 = BX_CPU(cpu)->gen_reg[8].rrx;
-		current_ctx_.r9 = BX_CPU(cpu)->gen_reg[9].rrx;
-		current_ctx_.r10 = BX_CPU(cpu)->gen_reg[10].rrx;
-		current_ctx_.r11 = BX_CPU(cpu)->gen_reg[11].rrx;
-		current_ctx_.r12 = BX_CPU(cpu)->gen_reg[12].rrx;
-		current_ctx_.r13 = BX_CPU(cpu)->gen_reg[13].rrx;
-		current_ctx_.r14 = BX_CPU(cpu)->gen_reg[14].rrx;
-		current_ctx_.r15 = BX_CPU(cpu)->gen_reg[15].rrx;
-		current_ctx_.cr0 = BX_CPU(cpu)->cr0.val32;
-		current_ctx_.cr2 = BX_CPU(cpu)->cr2;
-		current_ctx_.cr3 = BX_CPU(cpu)->cr3;
-		current_ctx_.cr4 = BX_CPU(cpu)->cr4.val32;
-		current_ctx_.fpu_sw = BX_CPU(cpu)->the_i387.get_status_word();
-		current_ctx_.fpu_cw = BX_CPU(cpu)->the_i387.get_control_word();
-		current_ctx_.fpu_tags = BX_CPU(cpu)->pack_FPU_TW(BX_CPU(cpu)->the_i387.get_tag_word());
-
-		auto sync_event = sync_file_.current_event();
+		update_current_context(cpu);
+
+		auto& sync_event = next_event_;
 
 		// The event is invalid, so it's the end
 		if (!sync_event.is_valid) {
@@ -793,15 +954,12 @@ void Replayer::interrupt(unsigned cpu, unsigned vector) {
 
 		if (BX_CPU(cpu)->prev_rip == sync_event.interrupt_rip) {
 			if (sync_event.start_context.are_values_equivalent(current_ctx_)) {
-				current_event_ = sync_event;
-				last_sync_point_ = current_event_.position;
-				sync_file_.next();
+				match_sync_event(sync_event);
 
 				LOG_MATCH_SYNC_EVENT_EXTRA(cpu, current_event_, sync_file_.sync_point_count(), begin_time_, " during an interrupt")
 			} else if (match_with_no_eflags(current_ctx_, sync_event.start_context)) {
-				current_event_ = sync_event;
-				last_sync_point_ = current_event_.position;
-				sync_file_.next();
+				match_sync_event(sync_event);
+				record_divergence(cpu, "matched during an interrupt without EFLAGS, differing " + differing_registers(current_ctx_, current_event_.start_context));
 
 				LOG_MATCH_SYNC_EVENT_EXTRA(cpu, current_event_, sync_file_.sync_point_count(), begin_time_, "during an interrupt without EFLAGS !")
 			}
@@ -825,6 +983,7 @@ void Replayer::interrupt(unsigned cpu, unsigned vector) {
 	#define UPDATE_FLAG_VALUE(name, value)                                      \
 		if (BX_CPU(cpu)->getB_##name() != (value)) {                            \
 			LOG_WARN("Forcing " << #name)                                       \
+			record_divergence(cpu, "forced " #name " on an interrupt");          \
 			BX_CPU(cpu)->set_##name(value);                                     \
 		}
 
@@ -841,6 +1000,7 @@ void Replayer::interrupt(unsigned cpu, unsigned vector) {
 	const auto expected_IOPL = (current_event_.rflags >> 12) & 0b11;
 	if (BX_CPU(cpu)->get_IOPL() != expected_IOPL) {
 		LOG_WARN("Forcing IOPL")
+		record_divergence(cpu, "forced IOPL on an interrupt");
 		BX_CPU(cpu)->set_IOPL((current_event_.rflags >> 12) & 3);
 	}
 
@@ -854,7 +1014,7 @@ void Replayer::interrupt(unsigned cpu, unsigned vector) {
 
 void Replayer::linear_access(unsigned cpu, std::uint64_t address, unsigned rw) {
 	// This PF is certainly legit, even if not detected by bochs because of TLB differences
-	if (current_event_.is_valid && current_event_.has_interrupt && current_rip_ == current_event_.interrupt_rip && current_event_.interrupt_vector == 0xE) {
+	if (is_page_fault_expected()) {
 		bool access_is_write = rw == BX_WRITE || rw == BX_RW;
 		bool pagefault_is_write = current_event_.fault_error_code & 0x2;
 
@@ -865,6 +1025,7 @@ void Replayer::linear_access(unsigned cpu, std::uint64_t address, unsigned rw) {
 		}
 
 		LOG_WARN("Forcing pagefault at address " << std::showbase << std::hex << address << " for Sync Event $" << std::dec << current_event_.position)
+		record_divergence(cpu, "forced a page fault not raised by Bochs");
 		BX_CPU(cpu)->page_fault(current_event_.fault_error_code, address, 0, rw);
 	}
 }
@@ -903,20 +1064,92 @@ void Replayer::apply_sync_event(unsigned cpu, const reven::vmghost::sync_event&
 	}
 }
 
-void Replayer::apply_hardware_access(unsigned cpu, uint64_t tsc) {
-	// We assume that we can't read more than 100KB in one access (We did see access of 92KB)
-	static const std::size_t read_data_size = 100 * 1024;
-	static std::uint8_t read_data[read_data_size];
+std::uint8_t* Replayer::map_chunk(const reven::vmghost::MemoryChunk& chunk) {
+	// Only a chunk stored raw and in full can be used in place: touching a page of the mapping
+	// past the end of the file would raise a SIGBUS in the middle of the replay
+	if (chunk.size_in_file() != chunk.size_in_memory()) {
+		return nullptr;
+	}
+
+	const std::uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+	const std::uint64_t file_offset = chunk.file_offset() & ~(page_size - 1);
+	const std::size_t size = chunk.size_in_file() + (chunk.file_offset() - file_offset);
+
+	int fd = ::open(core_file_.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat file_stat;
+	if (::fstat(fd, &file_stat) != 0 or static_cast<std::uint64_t>(file_stat.st_size) < chunk.file_offset() + chunk.size_in_file()) {
+		::close(fd);
+		return nullptr;
+	}
+
+	// Private mapping: the writes of the guest never reach the core file
+	void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, file_offset);
+	::close(fd);
+
+	if (address == MAP_FAILED) {
+		return nullptr;
+	}
+
+	std::uint8_t* memory = reinterpret_cast<std::uint8_t*>(address) + (chunk.file_offset() - file_offset);
+
+	mappings_.push_back({address, size, memory, chunk.physical_address(), chunk.size_in_file()});
+	return memory;
+}
 
+void Replayer::load_ram_chunk(unsigned cpu, const reven::vmghost::MemoryChunk& chunk, bool untouched_only) {
+	// The RAM is used in place from a mapping of the core file, so only the touched pages are read.
+	// Blocks that can't be mapped (legacy area, partial blocks, etc) are copied from it instead,
+	// as are the chunks that aren't stored raw in the file.
+	// With `untouched_only`, the blocks already holding memory (restored from a checkpoint) are kept.
+	std::unique_ptr<std::uint8_t[]> buffer;
+	std::uint8_t* memory = map_chunk(chunk);
+
+	if (memory == nullptr) {
+		LOG_WARN("Can't map the RAM from the core file, reading it instead")
+
+		buffer.reset(new std::uint8_t[chunk.size_in_memory()]);
+		chunk.read(chunk.physical_address(), buffer.get(), chunk.size_in_memory());
+		memory = buffer.get();
+	}
+
+	const bool can_map = buffer == nullptr and reinterpret_cast<std::uintptr_t>(memory) % 0x1000 == 0;
+
+	for (std::uint64_t offset = 0; offset < chunk.size_in_memory(); offset += BX_MEM_BLOCK_LEN) {
+		const std::uint64_t address = chunk.physical_address() + offset;
+		const std::uint64_t size = std::min<std::uint64_t>(BX_MEM_BLOCK_LEN, chunk.size_in_memory() - offset);
+
+		if (untouched_only and not BX_MEM(0)->is_block_untouched(address / BX_MEM_BLOCK_LEN)) {
+			continue;
+		}
+
+		if (can_map and size == BX_MEM_BLOCK_LEN and address % BX_MEM_BLOCK_LEN == 0
+		    and BX_MEM(0)->map_block(address / BX_MEM_BLOCK_LEN, memory + offset)) {
+			continue;
+		}
+
+		// dbg_set_mem won't modify the content of the buffer even if taking a non-const value
+		if (!BX_MEM(0)->dbg_set_mem(BX_CPU(cpu), address, size, memory + offset)) {
+			LOG_ERROR("Can't write memory of size " << chunk.size_in_memory() - offset << " at " << std::showbase << std::hex << address)
+			break;
+		}
+	}
+}
+
+void Replayer::apply_hardware_access(unsigned cpu, uint64_t tsc) {
 	BX_CPU(cpu)->set_TSC(tsc);
 
 	while (hardware_file_.current().valid() and hardware_file_.current().tsc <= tsc) {
 		const auto& access = hardware_file_.current();
+		++util::telemetry.hardware_accesses;
 
-		if (!access.is_write() && access.data.size() > read_data_size) {
-			LOG_DESYNC_HARDWARE_ACCESS(cpu, access)
-			LOG_DESYNC(cpu, "Encountered a read access bigger than the maximum size");
+		if (!access.is_write() && access.data.size() > read_buffer_.size()) {
+			read_buffer_.resize(access.data.size());
 		}
+		std::uint8_t* read_data = read_buffer_.data();
 
 		if (access.is_port()) {
 			if (access.is_write()) {
@@ -946,8 +1179,195 @@ void Replayer::apply_hardware_access(unsigned cpu, uint64_t tsc) {
 			}
 		}
 
-		hardware_file_.next();
+		next_hardware_access();
+	}
+}
+
+void Replayer::enable_checkpoints(const std::string& directory, std::uint64_t frequency) {
+	checkpoint_directory_ = directory;
+	checkpoint_frequency_ = frequency;
+}
+
+std::string Replayer::latest_checkpoint(const std::string& directory) {
+	std::ifstream latest(directory + "/latest");
+	std::string name;
+
+	if (!std::getline(latest, name) or name.empty()) {
+		return std::string();
+	}
+
+	return directory + "/" + name;
+}
+
+void Replayer::save_checkpoint(unsigned /* cpu */) {
+	const std::string name = std::to_string(last_sync_point_);
+	const std::string path = checkpoint_directory_ + "/" + name;
+
+	if (::mkdir(path.c_str(), 0755) != 0 and errno != EEXIST) {
+		LOG_ERROR("Can't create the checkpoint directory " << path)
+		return;
+	}
+
+	if (!SIM->save_state(path.c_str()) or !write_checkpoint_state(path + checkpoint_state_file)) {
+		LOG_ERROR("Can't save the checkpoint in " << path)
+		return;
+	}
+
+	// Only reference the checkpoint once it is complete
+	const std::string latest = checkpoint_directory_ + "/latest";
+	{
+		std::ofstream out(latest + ".tmp");
+		out << name << std::endl;
+	}
+	if (std::rename((latest + ".tmp").c_str(), latest.c_str()) != 0) {
+		LOG_ERROR("Can't update " << latest)
+		return;
+	}
+
+	LOG_INFO("Saved a checkpoint at Sync Event $" << std::dec << last_sync_point_ << " in " << path)
+}
+
+bool Replayer::write_checkpoint_state(const std::string& filename) const {
+	std::ofstream out(filename, std::ios::binary);
+
+	out.write(checkpoint_magic, sizeof(checkpoint_magic));
+	write_value(out, last_sync_point_);
+	write_value(out, sync_events_read_);
+	write_value(out, hardware_accesses_read_);
+	write_value<std::uint64_t>(out, reven_icount());
+
+	write_value<std::uint64_t>(out, ranges_.size());
+	for (const auto& range : ranges_) {
+		write_value(out, range.start_address);
+		write_value(out, range.size);
+		out.write(reinterpret_cast<const char*>(range.memory), range.size);
+	}
+
+	// The RAM from the core file mapping isn't in the Bochs state: only save the pages written since the start,
+	// the others are mapped again from the core file when resuming.
+	const std::uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+
+	for (const auto& mapping : mappings_) {
+		const std::uint64_t memory_offset = mapping.memory - reinterpret_cast<std::uint8_t*>(mapping.address);
+
+		for (auto offset : written_pages(mapping.address, mapping.size, page_size)) {
+			const std::uint64_t begin = std::max(offset, memory_offset);
+			const std::uint64_t end = std::min(offset + page_size, memory_offset + mapping.memory_size);
+
+			if (begin >= end)
+				continue;
+
+			write_value<std::uint64_t>(out, mapping.physical_address + begin - memory_offset);
+			write_value<std::uint64_t>(out, end - begin);
+			out.write(reinterpret_cast<const char*>(mapping.address) + begin, end - begin);
+		}
 	}
+
+	write_value<std::uint64_t>(out, 0);
+	write_value<std::uint64_t>(out, 0);
+
+	return static_cast<bool>(out);
+}
+
+bool Replayer::read_checkpoint_state(const std::string& filename) {
+	std::ifstream in(filename, std::ios::binary);
+
+	char magic[sizeof(checkpoint_magic)];
+	if (!in.read(magic, sizeof(magic)) or !std::equal(magic, magic + sizeof(magic), checkpoint_magic)) {
+		LOG_FATAL_ERROR("Can't read the checkpoint " << filename)
+		return false;
+	}
+
+	std::uint64_t sync_events_read = 0;
+	std::uint64_t hardware_accesses_read = 0;
+	std::uint64_t range_count = 0;
+
+	if (!read_value(in, last_sync_point_) or !read_value(in, sync_events_read) or !read_value(in, hardware_accesses_read)
+	    or !read_value(in, resumed_icount_) or !read_value(in, range_count)) {
+		LOG_FATAL_ERROR("Truncated checkpoint " << filename)
+		return false;
+	}
+
+	if (range_count != ranges_.size()) {
+		LOG_FATAL_ERROR("The checkpoint doesn't match the device memory of the core file")
+		return false;
+	}
+
+	for (auto& range : ranges_) {
+		std::uint64_t start_address = 0;
+		std::uint64_t size = 0;
+
+		if (!read_value(in, start_address) or !read_value(in, size) or start_address != range.start_address or size != range.size
+		    or !in.read(reinterpret_cast<char*>(range.memory), range.size)) {
+			LOG_FATAL_ERROR("The checkpoint doesn't match the device memory of the core file")
+			return false;
+		}
+	}
+
+	std::vector<std::uint8_t> page;
+
+	while (true) {
+		std::uint64_t address = 0;
+		std::uint64_t size = 0;
+
+		if (!read_value(in, address) or !read_value(in, size)) {
+			LOG_FATAL_ERROR("Truncated checkpoint " << filename)
+			return false;
+		}
+
+		if (size == 0)
+			break;
+
+		page.resize(size);
+		if (!in.read(reinterpret_cast<char*>(page.data()), size)) {
+			LOG_FATAL_ERROR("Truncated checkpoint " << filename)
+			return false;
+		}
+
+		for (std::uint64_t offset = 0; offset < size;) {
+			const std::uint64_t len = std::min<std::uint64_t>(size - offset, BX_MEM_BLOCK_LEN - (address + offset) % BX_MEM_BLOCK_LEN);
+			std::memcpy(BX_MEM(0)->get_vector(address + offset), page.data() + offset, len);
+			offset += len;
+		}
+	}
+
+	// The input files can only be read forward
+	while (sync_events_read_ < sync_events_read) {
+		next_sync_event();
+	}
+
+	while (hardware_accesses_read_ < hardware_accesses_read) {
+		next_hardware_access();
+	}
+
+	return true;
+}
+
+bool Replayer::resume(unsigned cpu, const std::string& checkpoint) {
+	BX_MEM(0)->enable_smram(true, true);
+
+	register_device_memory();
+
+	// The blocks that weren't mapped from the core file were restored with the Bochs state
+	core_.physical_memory()->visit_chunks([&](const reven::vmghost::MemoryChunk& chunk) {
+		if (is_ram_chunk(chunk)) {
+			load_ram_chunk(cpu, chunk, true);
+		}
+	});
+
+	if (!read_checkpoint_state(checkpoint + checkpoint_state_file)) {
+		return false;
+	}
+
+	BX_CPU(cpu)->TLB_flush();
+
+	std::cerr << "Info: Resuming from the checkpoint at Sync Event $" << std::dec << last_sync_point_ << std::endl;
+	return true;
+}
+
+void Replayer::next_hardware_access() {
+	hardware_file_.next();
+	++hardware_accesses_read_;
 }
 
 void Replayer::end_of_scenario(unsigned cpu, bool desync) {
@@ -957,6 +1377,8 @@ void Replayer::end_of_scenario(unsigned cpu, bool desync) {
 	std::cerr << "Info: Last validated sync point: $" << last_sync_point_ << std::endl;
 
 	desync_ = desync;
+	end_icount_ = reven_icount_started() ? reven_icount() : 0;
+	end_rip_ = BX_CPU(cpu)->prev_rip;
 
 	BX_CPU(cpu)->async_event = 1;
 	bx_pc_system.kill_bochs_request = 1;
@@ -964,49 +1386,94 @@ void Replayer::end_of_scenario(unsigned cpu, bool desync) {
 	longjmp(BX_CPU(cpu)->jmp_buf_env, 1);
 }
 
-size_t Replayer::get_memory_size() const {
-	size_t size = 0;
+void Replayer::record_divergence(unsigned cpu, const std::string& reason) {
+	if (first_divergence_) {
+		return;
+	}
 
-	core_.physical_memory()->visit_chunks([&size](const reven::vmghost::MemoryChunk& chunk) {
-		if (chunk.physical_address() == 0) {
-			size = chunk.size_in_memory();
+	first_divergence_ = Divergence{
+		current_event_.position,
+		reven_icount_started() ? reven_icount() : 0,
+		BX_CPU(cpu)->prev_rip,
+		reason
+	};
+}
+
+bool Replayer::is_ram_chunk(const reven::vmghost::MemoryChunk& chunk) const {
+	for (const auto& range : ram_ranges_) {
+		if (chunk.physical_address() == range.start_address) {
+			return true;
 		}
-	});
+	}
+
+	return false;
+}
 
-	if (size == 0) {
+size_t Replayer::get_memory_size() const {
+	if (ram_ranges_.empty()) {
 		throw std::runtime_error("Can't retrieve the size of the memory!");
 	}
 
-	return size;
+	return ram_ranges_.back().start_address + ram_ranges_.back().size;
+}
+
+const std::vector<Replayer::RamRange>& Replayer::get_ram_ranges() const {
+	return ram_ranges_;
+}
+
+bool Replayer::is_ram(std::uint64_t address) const {
+	for (const auto& range : ram_ranges_) {
+		if (address >= range.start_address and address - range.start_address < range.size)
+			return true;
+	}
+
+	return false;
 }
 
 const std::vector<Replayer::MemoryRange>& Replayer::get_memory_ranges() const {
 	return ranges_;
 }
 
+const Replayer::MemoryRange* Replayer::find_device_range(bx_phy_address addr) const {
+	auto it = std::upper_bound(ranges_.begin(), ranges_.end(), addr, [](bx_phy_address addr, const MemoryRange& range) {
+		return addr < range.start_address;
+	});
+
+	if (it == ranges_.begin())
+		return nullptr;
+
+	--it;
+	return addr - it->start_address < it->size ? &*it : nullptr;
+}
+
 void Replayer::device_memory_read(bx_phy_address addr, unsigned len, uint8_t *data) const {
-	for (auto& range : ranges_) {
-		if (addr >= range.start_address && addr - range.start_address < range.size) {
-			for (unsigned i = 0; i < len; ++i) {
-				*(data + i) = *(range.memory + (addr - range.start_address) + i);
-			}
+	const MemoryRange* range = find_device_range(addr);
 
-			break;
-		}
+	if (range != nullptr) {
+		const std::uint64_t offset = addr - range->start_address;
+		std::memcpy(data, range->memory + offset, std::min<std::uint64_t>(len, range->size - offset));
 	}
 }
 
 void Replayer::device_memory_write(bx_phy_address addr, unsigned len, uint8_t *data) {
-	for (auto& range : ranges_) {
-		if (addr >= range.start_address && addr - range.start_address < range.size) {
-			for (unsigned i = 0; i < len; ++i) {
-				*(range.memory + (addr - range.start_address) + i) = *(data + i);
-			}
+	const MemoryRange* range = find_device_range(addr);
 
-			break;
-		}
+	if (range != nullptr) {
+		const std::uint64_t offset = addr - range->start_address;
+		std::memcpy(range->memory + offset, data, std::min<std::uint64_t>(len, range->size - offset));
 	}
 }
 
+uint8_t* Replayer::device_memory_pointer(bx_phy_address addr) {
+	const MemoryRange* range = find_device_range(addr);
+
+	// The TLB maps whole pages: a range that doesn't cover them is only accessed through the handlers
+	if (range == nullptr or range->start_address % 0x1000 != 0 or range->size % 0x1000 != 0
+	    or reinterpret_cast<std::uintptr_t>(range->memory) % 0x1000 != 0)
+		return nullptr;
+
+	return range->memory + (addr - range->start_address);
+}
+
 }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <chrono>
+#include <experimental/optional>
 #include <string>
 
 #include "bochs.h"
@@ -22,6 +23,19 @@ public:
 		uint8_t *memory;
 	};
 
+	struct RamRange {
+		uint64_t start_address;
+		uint64_t size;
+	};
+
+	// A sync point where the state of the replay wasn't the recorded one, even if the replay could go on
+	struct Divergence {
+		std::uint64_t sync_point;
+		std::uint64_t icount;
+		std::uint64_t rip;
+		std::string reason;
+	};
+
 public:
 	Replayer();
 	~Replayer();
@@ -31,6 +45,22 @@ public:
 	bool reset(unsigned cpu);
 	void execute(unsigned cpu);
 
+	// Save a checkpoint in a sub-directory of `directory` every `frequency` validated sync points
+	void enable_checkpoints(const std::string& directory, std::uint64_t frequency);
+
+	// Path of the last complete checkpoint saved in `directory`, empty if there is none
+	static std::string latest_checkpoint(const std::string& directory);
+
+	// Restart from a checkpoint instead of the state of the core file.
+	// The Bochs state must already have been restored from the same checkpoint.
+	bool resume(unsigned cpu, const std::string& checkpoint);
+	std::uint64_t resumed_icount() const { return resumed_icount_; }
+
+	// Does the trace of `len` instructions at `i` always need the execution callbacks, whatever the sync points?
+	bool is_trace_instrumented(const bxInstruction_c *i, unsigned len) const;
+	// Does the trace of `len` bytes entered at the current RIP need the execution callbacks to reach the next sync event?
+	bool is_trace_needed(unsigned cpu, unsigned len) const;
+
 	void before_instruction(unsigned cpu, bxInstruction_c *i);
 	void after_instruction(unsigned cpu, bxInstruction_c *i);
 
@@ -39,23 +69,77 @@ public:
 
 	void linear_access(unsigned cpu, std::uint64_t address, unsigned rw);
 
+	// Can a linear access of the current instruction force a page fault? (see linear_access)
+	bool is_page_fault_expected() const {
+		return current_event_.is_valid && current_event_.has_interrupt && current_rip_ == current_event_.interrupt_rip
+		       && current_event_.interrupt_vector == 0xE;
+	}
+
 	void apply_sync_event(unsigned cpu, const reven::vmghost::sync_event& sync_event);
 	void apply_hardware_access(unsigned cpu, uint64_t tsc);
 	void end_of_scenario(unsigned cpu, bool desync);
 
+	// Size of the guest physical memory, up to the end of the last RAM range
 	size_t get_memory_size() const;
+	const std::vector<RamRange>& get_ram_ranges() const;
+	bool is_ram(std::uint64_t address) const;
 	const std::vector<MemoryRange>& get_memory_ranges() const;
 
 	void device_memory_read(bx_phy_address addr, unsigned len, uint8_t *data) const;
 	void device_memory_write(bx_phy_address addr, unsigned len, uint8_t *data);
+	uint8_t* device_memory_pointer(bx_phy_address addr);
 
 	bool get_desync() const { return desync_; };
 
+	// Position of the end of the replay (the desync if any)
+	std::uint64_t get_last_sync_point() const { return last_sync_point_; }
+	std::uint64_t get_end_icount() const { return end_icount_; }
+	std::uint64_t get_end_rip() const { return end_rip_; }
+
+	// The first sync point whose state had to be forced or was only partially matched
+	const std::experimental::optional<Divergence>& get_first_divergence() const { return first_divergence_; }
+
+	// Is the current instruction matching a sync event (which will be applied after it)?
+	bool is_sync_event_matched() const { return current_event_.is_valid; }
+
 private:
 	bool is_final_int3(unsigned cpu, const bxInstruction_c *i) const;
 
+	// Is the chunk one of the RAM ranges found by load? The others are the memory of the devices
+	bool is_ram_chunk(const reven::vmghost::MemoryChunk& chunk) const;
+
+	void register_device_memory();
+	const MemoryRange* find_device_range(bx_phy_address addr) const;
+	std::uint8_t* map_chunk(const reven::vmghost::MemoryChunk& chunk);
+	void load_ram_chunk(unsigned cpu, const reven::vmghost::MemoryChunk& chunk, bool untouched_only);
+
+	void save_checkpoint(unsigned cpu);
+	bool write_checkpoint_state(const std::string& filename) const;
+	bool read_checkpoint_state(const std::string& filename);
+	void next_hardware_access();
+
+	void record_divergence(unsigned cpu, const std::string& reason);
+
+	void update_current_context(unsigned cpu);
+	void match_sync_event(const reven::vmghost::sync_event& sync_event);
+	void next_sync_event();
+
 private:
+	struct Mapping {
+		void* address;
+		std::size_t size;
+
+		// Guest RAM in the mapping
+		std::uint8_t* memory;
+		std::uint64_t physical_address;
+		std::uint64_t memory_size;
+	};
+
+	std::string core_file_;
 	reven::vmghost::core_virtualbox core_;
+
+	// Private copy-on-write mappings of the core file backing the guest RAM
+	std::vector<Mapping> mappings_;
 	reven::vmghost::sync_file sync_file_;
 	reven::vmghost::hardware_file hardware_file_;
 
@@ -64,6 +148,9 @@ private:
 	uint64_t current_rip_{0};
 	BxExecutePtr_tR current_instruction_{nullptr};
 
+	// Next sync event to match, cached to avoid fetching it from the sync file on each instruction
+	reven::vmghost::sync_event next_event_;
+
 	// Current matched event (if not current_event_.is_valid will be false)
 	reven::vmghost::sync_event current_event_;
 
@@ -73,11 +160,29 @@ private:
 	// Used when we encounter a sync point with an interrupt to call at a later RIP
 	reven::vmghost::sync_event saved_interrupt_event_;
 
+	std::vector<RamRange> ram_ranges_;
+
+	// Memory of the devices, sorted by address
 	std::vector<MemoryRange> ranges_;
 
+	// Guest memory read back to validate the read hardware accesses, grown to the biggest access seen
+	std::vector<std::uint8_t> read_buffer_;
+
 	bool desync_{false};
+	std::uint64_t end_icount_{0};
+	std::uint64_t end_rip_{0};
+	std::experimental::optional<Divergence> first_divergence_;
 
 	std::uint64_t last_sync_point_{0};
+
+	// Number of entries consumed from the input files, to skip them when resuming
+	std::uint64_t sync_events_read_{0};
+	std::uint64_t hardware_accesses_read_{0};
+
+	std::string checkpoint_directory_;
+	std::uint64_t checkpoint_frequency_{0};
+	std::uint64_t sync_points_since_checkpoint_{0};
+	std::uint64_t resumed_icount_{0};
 };
 
 }
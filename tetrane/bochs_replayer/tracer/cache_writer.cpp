@@ -1,5 +1,7 @@
 #include "cache_writer.h"
 
+#include <algorithm>
+
 #include "bochs.h"
 #include "cpu/cpu.h"
 
@@ -8,6 +10,7 @@
 #include "trace_writer.h"
 
 #include "util/log.h"
+#include "util/telemetry.h"
 
 extern reven::replayer::Replayer replayer;
 
@@ -23,7 +26,7 @@ namespace reven {
 namespace tracer {
 
 BochsCacheWriter::BochsCacheWriter(const std::string& filename, const MachineDescription& desc,
-                                   std::uint64_t cache_frequency,
+                                   std::uint64_t cache_frequency, std::uint64_t max_dirty_pages,
                                    const char* tool_name, const char* tool_version, const char* tool_info)
   : CacheWriter(
     	std::make_unique<std::ofstream>(filename, std::ios::binary), TARGET_PAGE_SIZE, desc,
@@ -32,74 +35,152 @@ BochsCacheWriter::BochsCacheWriter(const std::string& filename, const MachineDes
   , cache_points_writer_(start_cache_points_section())
   , last_dumped_context_id_(0)
   , cache_frequency_(cache_frequency)
-  , memory_buffer_(header().page_size)
+  , max_dirty_pages_(max_dirty_pages)
+  , page_size_(header().page_size)
 {
+	for (const auto& region : machine().memory_regions) {
+		const std::uint64_t first_page = region.start - region.start % page_size_;
+		const std::uint64_t page_count = (region.start + region.size - first_page + page_size_ - 1) / page_size_;
 
+		dirty_regions_.push_back({region.start, region.size, first_page, std::vector<std::uint64_t>((page_count + 63) / 64, 0)});
+	}
 }
 
 void BochsCacheWriter::mark_memory_dirty(std::uint64_t address, std::uint64_t size)
 {
-	bool found_region = false;
-	for (const auto& region : machine().memory_regions) {
+	if (size == 0)
+		return;
+
+	// The RAM is the first region, so most writes are found in the first iteration
+	for (auto& region : dirty_regions_) {
 		if (address >= region.start and address + size <= region.start + region.size) {
-			found_region = true;
-			break;
-		}
-	}
+			const std::uint64_t first = (address - region.first_page) / page_size_;
+			const std::uint64_t last = (address + size - 1 - region.first_page) / page_size_;
 
-	if (not found_region)
-		return;
+			for (std::uint64_t page = first; page <= last; ++page) {
+				const std::uint64_t mask = std::uint64_t(1) << (page % 64);
 
-	size += address % header().page_size;
-	address -= address % header().page_size;
+				if (not (region.pages[page / 64] & mask)) {
+					region.pages[page / 64] |= mask;
+					++dirty_page_count_;
+				}
+			}
 
-	for(std::uint64_t sized_covered = 0; sized_covered < size; sized_covered += header().page_size) {
-		dirty_pages_.insert(address + sized_covered);
+			return;
+		}
 	}
 }
 
-void BochsCacheWriter::new_context(CpuContext* ctx, std::uint64_t context_id, std::uint64_t trace_stream_pos, const replayer::Replayer& replayer)
+void BochsCacheWriter::new_context(unsigned cpu, CpuContext* ctx, std::uint64_t context_id, std::uint64_t trace_stream_pos, const replayer::Replayer& replayer)
 {
-	if (context_id - last_dumped_context_id_ < cache_frequency_)
+	const bool too_many_dirty_pages = max_dirty_pages_ != 0 and dirty_page_count_ >= max_dirty_pages_;
+
+	if (context_id - last_dumped_context_id_ < cache_frequency_ and not too_many_dirty_pages)
 		return;
 	last_dumped_context_id_ = context_id;
 
-	cache_points_writer_.start_cache_point(context_id, trace_stream_pos);
+	const auto start = util::Telemetry::clock::now();
+
+	// The previous cache point must be written before its buffers are reused
+	wait_cache_point();
+
+	cache_point_.context_id = context_id;
+	cache_point_.trace_stream_pos = trace_stream_pos;
+
+	cache_point_.registers.clear();
 
 	#define REGISTER_ACTION(register, size, var) \
-	cache_points_writer_.write_register(reg_id(r_##register), reinterpret_cast<const std::uint8_t*>(&ctx->var), size);
+	cache_point_.registers.insert(cache_point_.registers.end(), reinterpret_cast<const std::uint8_t*>(&ctx->var), reinterpret_cast<const std::uint8_t*>(&ctx->var) + size);
 	#define REGISTER_CTX(register, size, var) \
-	cache_points_writer_.write_register(reg_id(r_##register), reinterpret_cast<const std::uint8_t*>(&ctx->var), size);
+	cache_point_.registers.insert(cache_point_.registers.end(), reinterpret_cast<const std::uint8_t*>(&ctx->var), reinterpret_cast<const std::uint8_t*>(&ctx->var) + size);
 	#define REGISTER_MSR(register, index) \
-	cache_points_writer_.write_register(reg_id(r_##register), reinterpret_cast<const std::uint8_t*>(&ctx->msrs[msr_##register]), 8);
+	cache_point_.registers.insert(cache_point_.registers.end(), reinterpret_cast<const std::uint8_t*>(&ctx->msrs[msr_##register]), reinterpret_cast<const std::uint8_t*>(&ctx->msrs[msr_##register]) + 8);
 	#include "registers.inc"
 	#undef REGISTER_MSR
 	#undef REGISTER_CTX
 	#undef REGISTER_ACTION
 
-	for (auto page : dirty_pages_) {
+	const auto page_size = page_size_;
+
+	cache_point_.pages.clear();
+	for (const auto& region : dirty_regions_) {
+		for (std::size_t word = 0; word < region.pages.size(); ++word) {
+			for (std::uint64_t bits = region.pages[word]; bits != 0; bits &= bits - 1) {
+				const std::uint64_t page = word * 64 + __builtin_ctzll(bits);
+				cache_point_.pages.push_back(region.first_page + page * page_size);
+			}
+		}
+	}
+	cache_point_.memory.resize(cache_point_.pages.size() * page_size);
+
+	std::uint8_t* page_buffer = cache_point_.memory.data();
+	for (auto page : cache_point_.pages) {
 		bool res = false;
-		if (page < replayer.get_memory_size()) {
-			res = BX_MEM(0)->dbg_fetch_mem(BX_CPU(0), page, header().page_size, memory_buffer_.data());
+		if (replayer.is_ram(page)) {
+			res = BX_MEM(0)->dbg_fetch_mem(BX_CPU(cpu), page, page_size, page_buffer);
 		} else {
-			replayer.device_memory_read(page, header().page_size, memory_buffer_.data());
+			replayer.device_memory_read(page, page_size, page_buffer);
 			res = true;
 		}
 
-		if (res) {
-			cache_points_writer_.write_memory_page(page, memory_buffer_.data());
-		} else {
-			LOG_DESYNC(0, "Couldn't read physical memory " << std::showbase << std::hex << page)
+		if (!res) {
+			LOG_DESYNC(cpu, "Couldn't read physical memory " << std::showbase << std::hex << page)
 			return;
 		}
+
+		page_buffer += page_size;
+	}
+	for (auto& region : dirty_regions_) {
+		std::fill(region.pages.begin(), region.pages.end(), 0);
+	}
+	dirty_page_count_ = 0;
+
+	cache_point_write_ = std::async(std::launch::async, &BochsCacheWriter::write_cache_point, this);
+
+	++util::telemetry.cache_points;
+	util::telemetry.cache_point_time += util::Telemetry::clock::now() - start;
+}
+
+void BochsCacheWriter::write_cache_point()
+{
+	cache_points_writer_.start_cache_point(cache_point_.context_id, cache_point_.trace_stream_pos);
+
+	const std::uint8_t* registers = cache_point_.registers.data();
+
+	#define REGISTER_ACTION(register, size, var) \
+	cache_points_writer_.write_register(reg_id(r_##register), registers, size); \
+	registers += size;
+	#define REGISTER_CTX(register, size, var) \
+	cache_points_writer_.write_register(reg_id(r_##register), registers, size); \
+	registers += size;
+	#define REGISTER_MSR(register, index) \
+	cache_points_writer_.write_register(reg_id(r_##register), registers, 8); \
+	registers += 8;
+	#include "registers.inc"
+	#undef REGISTER_MSR
+	#undef REGISTER_CTX
+	#undef REGISTER_ACTION
+
+	const std::uint8_t* page_buffer = cache_point_.memory.data();
+	for (auto page : cache_point_.pages) {
+		cache_points_writer_.write_memory_page(page, page_buffer);
+		page_buffer += page_size_;
 	}
-	dirty_pages_.clear();
 
 	cache_points_writer_.finish_cache_point();
 }
 
+void BochsCacheWriter::wait_cache_point()
+{
+	if (cache_point_write_.valid()) {
+		// Rethrows the errors of the background write
+		cache_point_write_.get();
+	}
+}
+
 void BochsCacheWriter::finalize()
 {
+	wait_cache_point();
 	finish_cache_points_section(std::move(cache_points_writer_));
 }
 
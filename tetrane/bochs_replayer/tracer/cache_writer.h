@@ -1,6 +1,7 @@
 #pragma once
 
-#include <set>
+#include <future>
+#include <vector>
 
 #include <rvnbintrace/cache_writer.h>
 #include <replayer/replayer.h>
@@ -16,20 +17,50 @@ struct CpuContext;
 
 class BochsCacheWriter : public CacheWriter {
 public:
-	BochsCacheWriter(const std::string& filename, const MachineDescription& desc, std::uint64_t cache_frequency,
+	// A cache point is written every `cache_frequency` instructions, or earlier once `max_dirty_pages`
+	// pages were written since the last one (0 to disable)
+	BochsCacheWriter(const std::string& filename, const MachineDescription& desc,
+	                 std::uint64_t cache_frequency, std::uint64_t max_dirty_pages,
 	                 const char* tool_name, const char* tool_version, const char* tool_info);
 
 	void mark_memory_dirty(std::uint64_t address, std::uint64_t size);
-	void new_context(CpuContext* ctx, std::uint64_t context_id, std::uint64_t trace_stream_pos, const replayer::Replayer& replayer);
+	void new_context(unsigned cpu, CpuContext* ctx, std::uint64_t context_id, std::uint64_t trace_stream_pos, const replayer::Replayer& replayer);
 
 	void finalize();
 
 private:
-	std::set<std::uint64_t> dirty_pages_;
+	// Snapshot of a cache point taken by the emulation, serialized by a background task
+	struct CachePoint {
+		std::uint64_t context_id;
+		std::uint64_t trace_stream_pos;
+		std::vector<std::uint8_t> registers; // Values of the registers, in the order of registers.inc
+		std::vector<std::uint64_t> pages;
+		std::vector<std::uint8_t> memory; // Content of the pages, one after the other
+	};
+
+	// One bit per page of a memory region of the machine
+	struct DirtyRegion {
+		std::uint64_t start;
+		std::uint64_t size;
+		std::uint64_t first_page; // Address of the page containing start
+		std::vector<std::uint64_t> pages;
+	};
+
+	void write_cache_point();
+	void wait_cache_point();
+
 	CachePointsSectionWriter cache_points_writer_;
 	std::uint64_t last_dumped_context_id_;
 	const std::uint64_t cache_frequency_;
-	std::vector<std::uint8_t> memory_buffer_;
+	const std::uint64_t max_dirty_pages_;
+
+	const std::uint64_t page_size_;
+	std::vector<DirtyRegion> dirty_regions_;
+	std::uint64_t dirty_page_count_{0};
+
+	// Only touched by the emulation when no write is in progress
+	CachePoint cache_point_;
+	std::future<void> cache_point_write_;
 };
 
 }
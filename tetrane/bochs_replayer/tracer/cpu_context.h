@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include "machine_description.h"
@@ -101,5 +102,33 @@ struct CpuContext {
 	std::uint64_t msrs[msr_enum_count];
 };
 
+// Groups of registers of the CpuContext that are only captured when an instruction may have written them.
+// The core registers (GPRs, EFLAGS, segments, CR/DR, descriptor tables) are cheap and always captured.
+enum RegisterClass : std::uint32_t {
+	RegisterClassCore = 1u << 0,
+	RegisterClassX87 = 1u << 1,
+	RegisterClassSimd = 1u << 2,
+	RegisterClassMsr = 1u << 3,
+
+	RegisterClassAll = RegisterClassCore | RegisterClassX87 | RegisterClassSimd | RegisterClassMsr,
+};
+
+// Class of the CpuContext member at this offset
+constexpr std::uint32_t register_class(std::size_t offset) {
+	if (offset >= offsetof(CpuContext, msrs))
+		return RegisterClassMsr;
+	if (offset >= offsetof(CpuContext, vmm))
+		return RegisterClassSimd;
+	if (offset >= offsetof(CpuContext, i387))
+		return RegisterClassX87;
+	return RegisterClassCore;
+}
+
+// Class of a MSR. FS/GS base alias the segment state and the TSC deadline is updated by the APIC,
+// so they can change without a WRMSR and are captured with the core registers.
+constexpr std::uint32_t register_class(x86MSR msr) {
+	return (msr == msr_fsbase or msr == msr_gsbase or msr == msr_tsc_deadline) ? RegisterClassCore : RegisterClassMsr;
+}
+
 }
 }
@@ -0,0 +1,97 @@
+#include "descriptor_cache.h"
+
+#include <algorithm>
+
+#include "bochs.h"
+#include "cpu/cpu.h"
+
+namespace reven {
+namespace tracer {
+
+namespace {
+	constexpr unsigned page_shift = 12;
+}
+
+std::uint64_t DescriptorCache::descriptor(unsigned cpu, unsigned seg) {
+	if (BX_CPU(cpu)->cr3 != cr3_) {
+		invalidate();
+		cr3_ = BX_CPU(cpu)->cr3;
+	}
+
+	const auto& selector = BX_CPU(cpu)->sregs[seg].selector;
+	const std::uint64_t table_base = selector.ti ? BX_CPU(cpu)->ldtr.cache.u.segment.base : BX_CPU(cpu)->gdtr.base;
+
+	Entry& entry = entries_[seg];
+
+	if (entry.valid and entry.selector == selector.value and entry.table_base == table_base) {
+		return entry.descriptor;
+	}
+
+	entry.selector = selector.value;
+	entry.table_base = table_base;
+	entry.linear_address = table_base + selector.index * 8;
+
+	// Keep the selector value if the descriptor can't be read, but don't cache it:
+	// the page could be mapped later without any change of CR3.
+	entry.descriptor = selector.value;
+	entry.valid = false;
+
+	// The table could be mapped at several linear addresses, so the writes are matched on the physical pages
+	bx_phy_address first = 0;
+	bx_phy_address last = 0;
+	if (not BX_CPU(cpu)->dbg_xlate_linear2phy(entry.linear_address, &first)
+	    or not BX_CPU(cpu)->dbg_xlate_linear2phy(entry.linear_address + 7, &last)) {
+		return entry.descriptor;
+	}
+
+	// The descriptor can cross a page boundary, each part is read from its own page
+	const std::uint64_t page_size = std::uint64_t(1) << page_shift;
+	const unsigned first_len = std::min<std::uint64_t>(8, page_size - (first & (page_size - 1)));
+
+	std::uint64_t descriptor = 0;
+	Bit8u* buffer = reinterpret_cast<Bit8u*>(&descriptor);
+	if (not BX_MEM(0)->dbg_fetch_mem(BX_CPU(cpu), first, first_len, buffer)) {
+		return entry.descriptor;
+	}
+	if (first_len < 8 and not BX_MEM(0)->dbg_fetch_mem(BX_CPU(cpu), last & ~(page_size - 1), 8 - first_len, buffer + first_len)) {
+		return entry.descriptor;
+	}
+
+	entry.descriptor = descriptor;
+	entry.physical_pages[0] = first >> page_shift;
+	entry.physical_pages[1] = last >> page_shift;
+	entry.valid = true;
+
+	return entry.descriptor;
+}
+
+void DescriptorCache::invalidate() {
+	for (auto& entry : entries_) {
+		entry.valid = false;
+	}
+}
+
+void DescriptorCache::invalidate_physical(std::uint64_t physical_address, std::size_t len) {
+	if (len == 0) {
+		return;
+	}
+
+	const std::uint64_t first_page = physical_address >> page_shift;
+	const std::uint64_t last_page = (physical_address + len - 1) >> page_shift;
+
+	for (auto& entry : entries_) {
+		if (not entry.valid) {
+			continue;
+		}
+
+		for (auto page : entry.physical_pages) {
+			if (first_page <= page and page <= last_page) {
+				entry.valid = false;
+				break;
+			}
+		}
+	}
+}
+
+}
+}
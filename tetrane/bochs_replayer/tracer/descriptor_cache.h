@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_context.h"
+
+namespace reven {
+namespace tracer {
+
+// Keep the descriptors of the segment registers read from the GDT/LDT between instructions.
+// An entry is only read again from the guest memory when its selector, the base of its descriptor table
+// or CR3 changes, or when a write lands on a physical page backing the descriptor.
+class DescriptorCache {
+public:
+	std::uint64_t descriptor(unsigned cpu, unsigned seg);
+
+	void invalidate();
+
+	// Physical writes, whatever the linear mapping used to reach the page
+	void invalidate_physical(std::uint64_t physical_address, std::size_t len);
+
+private:
+	struct Entry {
+		bool valid{false};
+
+		std::uint16_t selector{0};
+		std::uint64_t table_base{0};
+		std::uint64_t linear_address{0};
+
+		// Physical pages of the first and the last byte of the descriptor
+		std::uint64_t physical_pages[2]{0, 0};
+
+		std::uint64_t descriptor{0};
+	};
+
+	Entry entries_[SEG_REG_COUNT];
+	std::uint64_t cr3_{0};
+};
+
+}
+}
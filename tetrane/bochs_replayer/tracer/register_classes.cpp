@@ -0,0 +1,114 @@
+#include "register_classes.h"
+
+#include "bochs.h"
+#include "cpu/cpu.h"
+#include "cpu/decoder/fetchdecode.h"
+
+namespace reven {
+namespace tracer {
+
+namespace {
+
+constexpr bool is_x87_isa(unsigned isa) {
+	return isa == BX_ISA_X87 or isa == BX_ISA_MMX or isa == BX_ISA_3DNOW;
+}
+
+constexpr bool is_simd_isa(unsigned isa) {
+	switch (isa) {
+		case BX_ISA_SSE:
+		case BX_ISA_SSE2:
+		case BX_ISA_SSE3:
+		case BX_ISA_SSSE3:
+		case BX_ISA_SSE4_1:
+		case BX_ISA_SSE4_2:
+		case BX_ISA_SSE4A:
+		case BX_ISA_XSAVE:
+		case BX_ISA_XSAVEOPT:
+		case BX_ISA_XSAVEC:
+		case BX_ISA_XSAVES:
+		case BX_ISA_AES_PCLMULQDQ:
+		case BX_ISA_VAES_VPCLMULQDQ:
+		case BX_ISA_SHA:
+		case BX_ISA_GFNI:
+		case BX_ISA_AVX:
+		case BX_ISA_AVX2:
+		case BX_ISA_AVX_F16C:
+		case BX_ISA_AVX_FMA:
+		case BX_ISA_AVX_VNNI:
+		case BX_ISA_FMA4:
+		case BX_ISA_XOP:
+		case BX_ISA_AVX512:
+		case BX_ISA_AVX512_CD:
+		case BX_ISA_AVX512_PF:
+		case BX_ISA_AVX512_ER:
+		case BX_ISA_AVX512_DQ:
+		case BX_ISA_AVX512_BW:
+		case BX_ISA_AVX512_VL:
+		case BX_ISA_AVX512_VBMI:
+		case BX_ISA_AVX512_VBMI2:
+		case BX_ISA_AVX512_IFMA52:
+		case BX_ISA_AVX512_VPOPCNTDQ:
+		case BX_ISA_AVX512_VNNI:
+		case BX_ISA_AVX512_BITALG:
+		case BX_ISA_AVX512_VP2INTERSECT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Instructions that switch the whole CPU state
+constexpr bool is_virtualization_isa(unsigned isa) {
+	return isa == BX_ISA_VMX or isa == BX_ISA_SVM or isa == BX_ISA_SMX;
+}
+
+// MMX registers alias the x87 stack, and any MMX access resets the x87 TOS and tags
+constexpr bool is_x87_operand(Bit8u operand) {
+	return BX_DISASM_SRC_TYPE(operand) == BX_FPU_REG or BX_DISASM_SRC_TYPE(operand) == BX_MMX_REG or BX_DISASM_SRC_TYPE(operand) == BX_MMX_HALF_REG;
+}
+
+constexpr std::uint32_t opcode_register_classes(unsigned opcode, unsigned isa, Bit8u src1, Bit8u src2, Bit8u src3, Bit8u src4, unsigned attr) {
+	std::uint32_t classes = RegisterClassCore;
+
+	if (is_virtualization_isa(isa))
+		return RegisterClassAll;
+
+	if (is_x87_isa(isa) or is_x87_operand(src1) or is_x87_operand(src2) or is_x87_operand(src3) or is_x87_operand(src4))
+		classes |= RegisterClassX87;
+
+	if (is_simd_isa(isa) or (attr & (BX_PREPARE_SSE | BX_PREPARE_AVX | BX_PREPARE_EVEX | BX_PREPARE_OPMASK)))
+		classes |= RegisterClassSimd;
+
+	switch (opcode) {
+		case BX_IA_FXRSTOR:
+		case BX_IA_XRSTOR:
+		case BX_IA_XRSTORS:
+			classes |= RegisterClassX87 | RegisterClassSimd;
+			break;
+		case BX_IA_WRMSR:
+		case BX_IA_SWAPGS:
+			classes |= RegisterClassMsr;
+			break;
+		default:
+			break;
+	}
+
+	return classes;
+}
+
+#define bx_define_opcode(a, b, c, d, e, f, s1, s2, s3, s4, g) opcode_register_classes(a, f, s1, s2, s3, s4, g),
+const std::uint32_t opcodes_register_classes[] = {
+	#include "cpu/decoder/ia_opcodes.def"
+};
+#undef bx_define_opcode
+
+static_assert(sizeof(opcodes_register_classes) / sizeof(opcodes_register_classes[0]) == BX_IA_LAST, "Missing opcodes");
+
+}
+
+std::uint32_t instruction_register_classes(const bxInstruction_c* i) {
+	return opcodes_register_classes[i->getIaOpcode()];
+}
+
+}
+}
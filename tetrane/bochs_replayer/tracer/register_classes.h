@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu_context.h"
+
+namespace reven {
+namespace tracer {
+
+// Classes of registers (see RegisterClass) the instruction may write, computed from the decoder's metadata.
+// Always contains RegisterClassCore.
+std::uint32_t instruction_register_classes(const bxInstruction_c* i);
+
+}
+}
@@ -1,12 +1,13 @@
 #include "trace_writer.h"
 
-#include <fstream>
 #include <memory>
 #include <cstring>
+#include <cstddef>
 
 #include "cpu_context.h"
 #include "machine_description.h"
 
+#include "util/async_file_stream.h"
 #include "util/log.h"
 
 namespace reven {
@@ -73,7 +74,7 @@ inline void write_reg<ZmmRegister>(EventsSectionWriter& writer, x86Register reg,
 BochsWriter::BochsWriter(const std::string& filename, const MachineDescription& desc,
                          const char* tool_name, const char* tool_version, const char* tool_info)
   : TraceWriter(
-    	std::make_unique<std::ofstream>(filename, std::ios::binary), desc,
+    	std::make_unique<util::AsyncFileStream>(filename), desc,
     	tool_name, tool_version, tool_info
     )
 {
@@ -100,7 +101,7 @@ void save_initial_cpu_context(CpuContext* ctx, InitialRegistersSectionWriter& wr
 	#undef REGISTER_ACTION
 }
 
-void save_cpu_context(CpuContext* ctx, EventsSectionWriter& writer)
+void save_cpu_context(CpuContext* ctx, std::uint32_t classes, EventsSectionWriter& writer)
 {
 	if ((ctx->regs[REG_RIP] - comparison_ctx.regs[REG_RIP]) <= 15 and ctx->regs[REG_RIP] != comparison_ctx.regs[REG_RIP]) {
 		writer.write_register_action(
@@ -156,9 +157,11 @@ void save_cpu_context(CpuContext* ctx, EventsSectionWriter& writer)
 
 	#define REGISTER_ACTION(register, size, var)
 	#define REGISTER_CTX(register, size, var) \
-	write_reg(writer, r_##register, size, ctx->var, comparison_ctx.var);
+	if (classes & register_class(offsetof(CpuContext, var))) \
+		write_reg(writer, r_##register, size, ctx->var, comparison_ctx.var);
 	#define REGISTER_MSR(register, index) \
-	write_reg(writer, r_##register, 8, ctx->msrs[msr_##register], comparison_ctx.msrs[msr_##register]);
+	if (classes & register_class(msr_##register)) \
+		write_reg(writer, r_##register, 8, ctx->msrs[msr_##register], comparison_ctx.msrs[msr_##register]);
 	#include "registers.inc"
 	#undef REGISTER_MSR
 	#undef REGISTER_CTX
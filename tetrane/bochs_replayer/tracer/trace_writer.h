@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include <rvnbintrace/trace_writer.h>
 
 using namespace reven::backend::plugins::file::libbintrace;
@@ -16,7 +18,8 @@ public:
 };
 
 void save_initial_cpu_context(CpuContext* ctx, InitialRegistersSectionWriter& writer);
-void save_cpu_context(CpuContext* ctx, EventsSectionWriter& writer);
+// Only the registers of the classes (see RegisterClass) are compared against the previous context
+void save_cpu_context(CpuContext* ctx, std::uint32_t classes, EventsSectionWriter& writer);
 
 }
 }
@@ -10,6 +10,7 @@
 #include "bxversion.h"
 
 #include "util/log.h"
+#include "util/telemetry.h"
 #include "tetrane/bochs_replayer/icount/fns.h"
 
 extern reven::replayer::Replayer replayer;
@@ -29,6 +30,9 @@ std::vector<RegisterId> register_action_ids;
 
 namespace {
 
+// Bound the size of a coalesced write (e.g. a REP STOS over a large buffer)
+constexpr std::size_t max_coalesced_write = 64 * 1024;
+
 template <typename T>
 static std::vector<std::uint8_t> value_to_buffer(const T& value)
 {
@@ -123,7 +127,9 @@ static MachineDescription x64_machine_description(unsigned cpu, const replayer::
 	desc.static_registers["cpuid_max_phy_addr"] = value_to_buffer<std::uint8_t>(0x3024 & 0xFF);
 	desc.static_registers["cpuid_max_lin_addr"] = value_to_buffer<std::uint8_t>((0x3024 >> 8) & 0xFF);
 
-	desc.memory_regions.push_back({ 0, replayer.get_memory_size() });
+	for (const auto& ram_range : replayer.get_ram_ranges()) {
+		desc.memory_regions.push_back({ram_range.start_address, ram_range.size});
+	}
 
 	for (const auto& memory_range : replayer.get_memory_ranges()) {
 		desc.memory_regions.push_back({memory_range.start_address, memory_range.size});
@@ -214,9 +220,8 @@ static std::uint64_t read_msr(unsigned cpu) {
 	return 0;
 }
 
-static reven::tracer::CpuContext create_cpu_context(unsigned cpu) {
-	reven::tracer::CpuContext ctx;
-
+// Refresh the registers of ctx belonging to one of the classes, the others keep their previous value
+static void update_cpu_context(unsigned cpu, reven::tracer::CpuContext& ctx, std::uint32_t classes, DescriptorCache& descriptor_cache) {
 	std::memcpy(&ctx.regs, BX_CPU(cpu)->gen_reg, sizeof(ctx.regs));
 	ctx.regs[BX_64BIT_REG_RIP] = BX_CPU(cpu)->prev_rip;
 
@@ -227,13 +232,7 @@ static reven::tracer::CpuContext create_cpu_context(unsigned cpu) {
 	}
 
 	for (unsigned i = 0; i < reven::tracer::SEG_REG_COUNT; ++i) {
-		ctx.seg_regs_shadow[i] = BX_CPU(cpu)->sregs[i].selector.value;
-
-		// TODO: Construct it from the cache
-		if (BX_CPU(cpu)->sregs[i].selector.ti)
-			bx_dbg_read_linear(cpu, BX_CPU(dbg_cpu)->ldtr.cache.u.segment.base + BX_CPU(cpu)->sregs[i].selector.index * 8,8, (Bit8u*)&ctx.seg_regs_shadow[i]);
-		else
-			bx_dbg_read_linear(cpu, BX_CPU(dbg_cpu)->gdtr.base + BX_CPU(cpu)->sregs[i].selector.index * 8,8, (Bit8u*)&ctx.seg_regs_shadow[i]);
+		ctx.seg_regs_shadow[i] = descriptor_cache.descriptor(cpu, i);
 	}
 
 	#if BX_SUPPORT_PKEYS
@@ -266,40 +265,49 @@ static reven::tracer::CpuContext create_cpu_context(unsigned cpu) {
 	ctx.dr[6] = BX_CPU(cpu)->dr6.get32();
 	ctx.dr[7] = BX_CPU(cpu)->dr7.get32();
 
-	for (unsigned i = 0; i < 8; ++i) {
-		std::memcpy(&ctx.i387.fpregs[i].value, &BX_CPU(cpu)->the_i387.st_space[i].fraction, sizeof(BX_CPU(cpu)->the_i387.st_space[i].fraction));
-		std::memcpy(&ctx.i387.fpregs[i].value[sizeof(BX_CPU(cpu)->the_i387.st_space[i].fraction)], &BX_CPU(cpu)->the_i387.st_space[i].fraction, sizeof(BX_CPU(cpu)->the_i387.st_space[i].exp));
-	}
+	if (classes & RegisterClassX87) {
+		for (unsigned i = 0; i < 8; ++i) {
+			std::memcpy(&ctx.i387.fpregs[i].value, &BX_CPU(cpu)->the_i387.st_space[i].fraction, sizeof(BX_CPU(cpu)->the_i387.st_space[i].fraction));
+			std::memcpy(&ctx.i387.fpregs[i].value[sizeof(BX_CPU(cpu)->the_i387.st_space[i].fraction)], &BX_CPU(cpu)->the_i387.st_space[i].fraction, sizeof(BX_CPU(cpu)->the_i387.st_space[i].exp));
+		}
 
-	ctx.i387.fip = BX_CPU(cpu)->the_i387.fip;
-	ctx.i387.fdp = BX_CPU(cpu)->the_i387.fdp;
-	ctx.i387.foo = BX_CPU(cpu)->the_i387.foo;
-	ctx.i387.swd = BX_CPU(cpu)->the_i387.get_status_word();
-	ctx.i387.cwd = BX_CPU(cpu)->the_i387.get_control_word();
-	ctx.i387.twd = BX_CPU(cpu)->the_i387.get_tag_word();
+		ctx.i387.fip = BX_CPU(cpu)->the_i387.fip;
+		ctx.i387.fdp = BX_CPU(cpu)->the_i387.fdp;
+		ctx.i387.foo = BX_CPU(cpu)->the_i387.foo;
+		ctx.i387.swd = BX_CPU(cpu)->the_i387.get_status_word();
+		ctx.i387.cwd = BX_CPU(cpu)->the_i387.get_control_word();
+		ctx.i387.twd = BX_CPU(cpu)->the_i387.get_tag_word();
+	}
 
-	#if BX_SUPPORT_EVEX
-		std::memcpy(&ctx.vmm, BX_CPU(cpu)->vmm, sizeof(ctx.vmm));
-	#else
-		#error Must support EVEX to work
-	#endif
+	if (classes & RegisterClassSimd) {
+		#if BX_SUPPORT_EVEX
+			std::memcpy(&ctx.vmm, BX_CPU(cpu)->vmm, sizeof(ctx.vmm));
+		#else
+			#error Must support EVEX to work
+		#endif
 
-	ctx.mxcsr = BX_CPU(cpu)->mxcsr.mxcsr;
+		ctx.mxcsr = BX_CPU(cpu)->mxcsr.mxcsr;
+	}
 
 	#define REGISTER_ACTION(register, size, ctx)
 	#define REGISTER_CTX(register, size, ctx)
-	#define REGISTER_MSR(register, index) ctx.msrs[msr_##register] = read_msr<(index)>(cpu);
+	#define REGISTER_MSR(register, index) \
+	if (classes & register_class(msr_##register)) \
+		ctx.msrs[msr_##register] = read_msr<(index)>(cpu);
 	#include "registers.inc"
 	#undef REGISTER_MSR
 	#undef REGISTER_CTX
 	#undef REGISTER_ACTION
-
-	return ctx;
 }
 
 }
 
-Tracer::Tracer(const std::string& trace_dir) : trace_dir_(trace_dir) {}
+Tracer::Tracer(const std::string& trace_dir, std::uint64_t cache_frequency, std::uint64_t cache_max_dirty_pages, bool coalesce_memory_writes)
+  : trace_dir_(trace_dir)
+  , cache_frequency_(cache_frequency)
+  , cache_max_dirty_pages_(cache_max_dirty_pages)
+  , coalesce_memory_writes_(coalesce_memory_writes)
+{}
 
 void Tracer::init(unsigned cpu, const replayer::Replayer& replayer) {
 	machine_ = x64_machine_description(cpu, replayer);
@@ -319,7 +327,7 @@ void Tracer::init(unsigned cpu, const replayer::Replayer& replayer) {
 
 	trace_writer_.emplace(trace_dir_ + "/trace.bin", machine_, tool_name, tool_version, tool_info);
 
-	cache_writer_.emplace(trace_dir_ + "/trace.cache", machine_, 1000000, tool_name, tool_version, tool_info);
+	cache_writer_.emplace(trace_dir_ + "/trace.cache", machine_, cache_frequency_, cache_max_dirty_pages_, tool_name, tool_version, tool_info);
 }
 
 void Tracer::start(unsigned cpu, const replayer::Replayer& replayer) {
@@ -329,14 +337,25 @@ void Tracer::start(unsigned cpu, const replayer::Replayer& replayer) {
 	uint8_t zero_buf[TARGET_PAGE_SIZE];
 	std::memset(zero_buf, 0, TARGET_PAGE_SIZE);
 
-	for (size_t addr = 0; addr < BX_MEM(0)->get_memory_len(); addr += TARGET_PAGE_SIZE) {
-		auto size = std::min<std::size_t>(TARGET_PAGE_SIZE, BX_MEM(0)->get_memory_len() - addr);
-		auto res = BX_MEM(0)->dbg_fetch_mem(BX_CPU(cpu), addr, size, mem_buf);
+	for (const auto& ram_range : replayer.get_ram_ranges()) {
+		const std::uint64_t end = ram_range.start_address + ram_range.size;
+
+		for (std::uint64_t addr = ram_range.start_address; addr < end; addr += TARGET_PAGE_SIZE) {
+			auto size = std::min<std::size_t>(TARGET_PAGE_SIZE, end - addr);
+
+			// Don't allocate the blocks that were never written just to read zeroes from them
+			if (BX_MEM(0)->is_block_untouched(addr / BX_MEM_BLOCK_LEN)) {
+				memory_writer.write(zero_buf, size);
+				continue;
+			}
+
+			auto res = BX_MEM(0)->dbg_fetch_mem(BX_CPU(cpu), addr, size, mem_buf);
 
-		if (!res) { // I/O. Just fill page with zeroes.
-			memory_writer.write(zero_buf, size);
-		} else {
-			memory_writer.write(mem_buf, size);
+			if (!res) { // I/O. Just fill page with zeroes.
+				memory_writer.write(zero_buf, size);
+			} else {
+				memory_writer.write(mem_buf, size);
+			}
 		}
 	}
 
@@ -349,8 +368,9 @@ void Tracer::start(unsigned cpu, const replayer::Replayer& replayer) {
 
 	auto cpu_writer = trace_writer_->start_initial_registers_section(std::move(memory_writer));
 
-	auto ctx = create_cpu_context(cpu);
-	save_initial_cpu_context(&ctx, cpu_writer);
+	update_cpu_context(cpu, ctx_, RegisterClassAll, descriptor_cache_);
+	save_initial_cpu_context(&ctx_, cpu_writer);
+	dirty_registers_ = RegisterClassCore;
 
 	packet_writer_.emplace(trace_writer_->start_events_section(std::move(cpu_writer)));
 
@@ -359,8 +379,10 @@ void Tracer::start(unsigned cpu, const replayer::Replayer& replayer) {
 
 void Tracer::end() {
 	if (trace_writer_ and packet_writer_) {
-		if (packet_writer_->is_event_started())
+		if (packet_writer_->is_event_started()) {
+			flush_memory_write();
 			packet_writer_->finish_event();
+		}
 
 		trace_writer_->finish_events_section(std::move(packet_writer_).value());
 		trace_writer_ = std::experimental::nullopt;
@@ -382,8 +404,11 @@ void Tracer::execute_instruction(unsigned cpu, const replayer::Replayer& replaye
 		packet_writer_->start_event_instruction();
 	}
 
-	auto ctx = create_cpu_context(cpu);
-	save_cpu_context(&ctx, *packet_writer_);
+	flush_memory_write();
+
+	update_cpu_context(cpu, ctx_, dirty_registers_, descriptor_cache_);
+	save_cpu_context(&ctx_, dirty_registers_, *packet_writer_);
+	dirty_registers_ = RegisterClassCore;
 	packet_writer_->finish_event();
 
 	if (packet_writer_->event_count() != reven_icount()) {
@@ -392,10 +417,24 @@ void Tracer::execute_instruction(unsigned cpu, const replayer::Replayer& replaye
 		return;
 	}
 
-	cache_writer_->new_context(&ctx, packet_writer_->event_count(), packet_writer_->stream_pos(), replayer);
+	util::telemetry.trace_bytes = packet_writer_->stream_pos();
+	cache_writer_->new_context(cpu, &ctx_, packet_writer_->event_count(), packet_writer_->stream_pos(), replayer);
 }
 
-void Tracer::linear_memory_access(std::uint64_t /* linear_address */, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool /* read */, bool write, bool /* execute */) {
+void Tracer::after_instruction(const bxInstruction_c* i, const replayer::Replayer& replayer) {
+	// The replayer can overwrite the context when applying a sync event
+	if (replayer.is_sync_event_matched()) {
+		dirty_registers_ = RegisterClassAll;
+	} else {
+		dirty_registers_ |= instruction_register_classes(i);
+	}
+}
+
+void Tracer::mark_registers_dirty(std::uint32_t classes) {
+	dirty_registers_ |= classes;
+}
+
+void Tracer::linear_memory_access(unsigned /* cpu */, std::uint64_t /* linear_address */, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool /* read */, bool write, bool /* execute */) {
 	if (!write) {
 		return;
 	}
@@ -404,11 +443,11 @@ void Tracer::linear_memory_access(std::uint64_t /* linear_address */, std::uint6
 		packet_writer_->start_event_instruction();
 	}
 
-	packet_writer_->write_memory(physical_address, data, len);
-	cache_writer_->mark_memory_dirty(physical_address, len);
+	write_memory(physical_address, data, len);
+	descriptor_cache_.invalidate_physical(physical_address, len);
 }
 
-void Tracer::physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* data, bool /* read */, bool write, bool /* execute */) {
+void Tracer::physical_memory_access(unsigned /* cpu */, std::uint64_t address, std::size_t len, const std::uint8_t* data, bool /* read */, bool write, bool /* execute */) {
 	if (!write) {
 		return;
 	}
@@ -417,8 +456,8 @@ void Tracer::physical_memory_access(std::uint64_t address, std::size_t len, cons
 		packet_writer_->start_event_instruction();
 	}
 
-	packet_writer_->write_memory(address, data, len);
-	cache_writer_->mark_memory_dirty(address, len);
+	write_memory(address, data, len);
+	descriptor_cache_.invalidate_physical(address, len);
 
 	// Physical access are mainly done by the MMU
 	// We don't want to keep MMU accesses, because they have a huge impact on the database's size.
@@ -433,8 +472,36 @@ void Tracer::device_physical_memory_access(std::uint64_t address, std::size_t le
 		packet_writer_->start_event_instruction();
 	}
 
-	packet_writer_->write_memory(address, data, len);
+	write_memory(address, data, len);
+	descriptor_cache_.invalidate_physical(address, len);
+}
+
+void Tracer::write_memory(std::uint64_t address, const std::uint8_t* data, std::size_t len) {
 	cache_writer_->mark_memory_dirty(address, len);
+
+	if (!coalesce_memory_writes_) {
+		packet_writer_->write_memory(address, data, len);
+		return;
+	}
+
+	// Only strictly contiguous writes are merged, so the order of overlapping writes is kept
+	if (!pending_write_.empty() and
+	    (address != pending_write_address_ + pending_write_.size() or pending_write_.size() + len > max_coalesced_write)) {
+		flush_memory_write();
+	}
+
+	if (pending_write_.empty())
+		pending_write_address_ = address;
+
+	pending_write_.insert(pending_write_.end(), data, data + len);
+}
+
+void Tracer::flush_memory_write() {
+	if (pending_write_.empty())
+		return;
+
+	packet_writer_->write_memory(pending_write_address_, pending_write_.data(), pending_write_.size());
+	pending_write_.clear();
 }
 
 void Tracer::interrupt(unsigned cpu, unsigned vector) {
@@ -447,8 +514,12 @@ void Tracer::interrupt(unsigned cpu, unsigned vector) {
 		packet_writer_->start_event_instruction();
 	}
 
-	auto ctx = create_cpu_context(cpu);
-	save_cpu_context(&ctx, *packet_writer_);
+	flush_memory_write();
+
+	// The last instruction didn't complete, and the event itself can change anything
+	update_cpu_context(cpu, ctx_, RegisterClassAll, descriptor_cache_);
+	save_cpu_context(&ctx_, RegisterClassAll, *packet_writer_);
+	dirty_registers_ = RegisterClassAll;
 
 	packet_writer_->finish_event();
 
@@ -466,8 +537,12 @@ void Tracer::exception(unsigned cpu, unsigned vector, unsigned error_code, const
 		packet_writer_->start_event_instruction();
 	}
 
-	auto ctx = create_cpu_context(cpu);
-	save_cpu_context(&ctx, *packet_writer_);
+	flush_memory_write();
+
+	// The last instruction didn't complete, and the event itself can change anything
+	update_cpu_context(cpu, ctx_, RegisterClassAll, descriptor_cache_);
+	save_cpu_context(&ctx_, RegisterClassAll, *packet_writer_);
+	dirty_registers_ = RegisterClassAll;
 
 	packet_writer_->finish_event();
 
@@ -1,11 +1,14 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <experimental/optional>
 
 #include "cache_writer.h"
 #include "cpu_context.h"
+#include "descriptor_cache.h"
 #include "machine_description.h"
+#include "register_classes.h"
 #include "trace_writer.h"
 
 #include <replayer/replayer.h>
@@ -15,7 +18,7 @@ namespace tracer {
 
 class Tracer {
 public:
-	Tracer(const std::string& trace_dir);
+	Tracer(const std::string& trace_dir, std::uint64_t cache_frequency, std::uint64_t cache_max_dirty_pages, bool coalesce_memory_writes);
 
 	void init(unsigned cpu, const replayer::Replayer& replayer);
 
@@ -23,15 +26,25 @@ public:
 	void end();
 
 	void execute_instruction(unsigned cpu, const replayer::Replayer& replayer);
-	void linear_memory_access(std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
-	void physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
+	void after_instruction(const bxInstruction_c* i, const replayer::Replayer& replayer);
+	void linear_memory_access(unsigned cpu, std::uint64_t linear_address, std::uint64_t physical_address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
+	void physical_memory_access(unsigned cpu, std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write, bool execute);
 	void device_physical_memory_access(std::uint64_t address, std::size_t len, const std::uint8_t* data, bool read, bool write);
 
 	void interrupt(unsigned cpu, unsigned vector);
 	void exception(unsigned cpu, unsigned vector, unsigned error_code, const replayer::Replayer& replayer);
 
+	// Force the next capture of these classes of registers, for changes done outside of an instruction
+	void mark_registers_dirty(std::uint32_t classes);
+
 private:
+	void write_memory(std::uint64_t address, const std::uint8_t* data, std::size_t len);
+	void flush_memory_write();
+
 	std::string trace_dir_;
+	std::uint64_t cache_frequency_;
+	std::uint64_t cache_max_dirty_pages_;
+	bool coalesce_memory_writes_;
 
 	bool started_{false};
 	bool in_exception_{false}; // Are we executing an exception? (will be reset to false after the next instruction)
@@ -41,6 +54,15 @@ private:
 	std::experimental::optional<BochsCacheWriter> cache_writer_;
 
 	MachineDescription machine_;
+	DescriptorCache descriptor_cache_;
+
+	// Last captured context, only the dirty classes of registers are refreshed on the next capture
+	CpuContext ctx_;
+	std::uint32_t dirty_registers_{RegisterClassAll};
+
+	// Write of the current event not yet written in the trace, extended by the following adjacent writes
+	std::uint64_t pending_write_address_{0};
+	std::vector<std::uint8_t> pending_write_;
 };
 
 }
@@ -0,0 +1,174 @@
+#include "async_file_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace reven {
+namespace util {
+
+AsyncFileStream::AsyncFileStream(const std::string& filename, std::size_t buffer_size, std::size_t buffer_count)
+  : std::ostream(nullptr)
+  , buffer_(filename, buffer_size, buffer_count)
+{
+	rdbuf(&buffer_);
+
+	if (!buffer_.is_open())
+		setstate(std::ios_base::failbit);
+}
+
+AsyncFileStream::~AsyncFileStream() {
+	flush();
+}
+
+AsyncFileStream::Buffer::Buffer(const std::string& filename, std::size_t buffer_size, std::size_t buffer_count)
+  : file_(filename, std::ios::binary)
+  , buffer_size_(buffer_size)
+  , buffer_count_(buffer_count)
+  , current_(buffer_size)
+{
+	setp(current_.data(), current_.data() + current_.size());
+
+	thread_ = std::thread(&Buffer::write_thread, this);
+}
+
+AsyncFileStream::Buffer::~Buffer() {
+	sync();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+
+	thread_.join();
+}
+
+AsyncFileStream::Buffer::int_type AsyncFileStream::Buffer::overflow(int_type ch) {
+	if (!submit())
+		return traits_type::eof();
+
+	if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(ch);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(ch);
+}
+
+std::streamsize AsyncFileStream::Buffer::xsputn(const char* s, std::streamsize n) {
+	std::streamsize written = 0;
+
+	while (written < n) {
+		if (pptr() == epptr() and !submit())
+			break;
+
+		const auto size = std::min<std::streamsize>(n - written, epptr() - pptr());
+		std::memcpy(pptr(), s + written, size);
+		pbump(static_cast<int>(size));
+		written += size;
+	}
+
+	return written;
+}
+
+int AsyncFileStream::Buffer::sync() {
+	if (!submit() or !wait_pending())
+		return -1;
+
+	file_.flush();
+	return file_ ? 0 : -1;
+}
+
+AsyncFileStream::Buffer::pos_type AsyncFileStream::Buffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	if (!(which & std::ios_base::out))
+		return pos_type(off_type(-1));
+
+	// tellp is called for each event, don't wait for the writer thread
+	if (off == 0 and dir == std::ios_base::cur)
+		return pos_type(position_ + (pptr() - pbase()));
+
+	if (sync() != 0)
+		return pos_type(off_type(-1));
+
+	file_.seekp(off, dir);
+	const auto pos = file_.tellp();
+
+	if (!file_)
+		return pos_type(off_type(-1));
+
+	position_ = pos;
+	return pos;
+}
+
+AsyncFileStream::Buffer::pos_type AsyncFileStream::Buffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+bool AsyncFileStream::Buffer::submit() {
+	const auto size = static_cast<std::size_t>(pptr() - pbase());
+
+	if (size > 0) {
+		current_.resize(size);
+		position_ += size;
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return in_flight_ < buffer_count_ or error_; });
+
+		pending_.push_back(std::move(current_));
+		++in_flight_;
+
+		if (free_.empty()) {
+			current_ = std::vector<char>();
+		} else {
+			current_ = std::move(free_.back());
+			free_.pop_back();
+		}
+
+		lock.unlock();
+		cv_.notify_all();
+
+		current_.resize(buffer_size_);
+		setp(current_.data(), current_.data() + current_.size());
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	return !error_;
+}
+
+bool AsyncFileStream::Buffer::wait_pending() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	cv_.wait(lock, [this] { return in_flight_ == 0; });
+
+	return !error_;
+}
+
+void AsyncFileStream::Buffer::write_thread() {
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (true) {
+		cv_.wait(lock, [this] { return !pending_.empty() or stop_; });
+
+		if (pending_.empty())
+			break;
+
+		auto buffer = std::move(pending_.front());
+		pending_.pop_front();
+
+		// The file is only used by the main thread when nothing is in flight
+		lock.unlock();
+		file_.write(buffer.data(), buffer.size());
+		const bool failed = !file_;
+		lock.lock();
+
+		error_ = error_ or failed;
+
+		buffer.clear();
+		free_.push_back(std::move(buffer));
+		--in_flight_;
+
+		cv_.notify_all();
+	}
+}
+
+}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace reven {
+namespace util {
+
+// Output file stream whose writes to the disk are done by a background thread.
+// Data is accumulated in large buffers handed to the thread when full. At most `buffer_count` buffers are waiting
+// for the disk: past that, the writer blocks until one is written, which bounds the memory used.
+// Seeking (other than querying the position) waits for every pending buffer to be written.
+class AsyncFileStream : public std::ostream {
+public:
+	AsyncFileStream(const std::string& filename, std::size_t buffer_size = 4 * 1024 * 1024, std::size_t buffer_count = 4);
+	~AsyncFileStream();
+
+private:
+	class Buffer : public std::streambuf {
+	public:
+		Buffer(const std::string& filename, std::size_t buffer_size, std::size_t buffer_count);
+		~Buffer();
+
+		bool is_open() const { return file_.is_open(); }
+
+	protected:
+		int_type overflow(int_type ch) override;
+		std::streamsize xsputn(const char* s, std::streamsize n) override;
+		int sync() override;
+
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+	private:
+		bool submit();
+		bool wait_pending();
+		void write_thread();
+
+		std::ofstream file_;
+
+		const std::size_t buffer_size_;
+		const std::size_t buffer_count_;
+
+		// Buffer being filled, `position_` is its offset in the file
+		std::vector<char> current_;
+		std::streamoff position_{0};
+
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::deque<std::vector<char>> pending_;
+		std::vector<std::vector<char>> free_;
+		std::size_t in_flight_{0};
+		bool stop_{false};
+		bool error_{false};
+
+		std::thread thread_;
+	};
+
+	Buffer buffer_;
+};
+
+}
+}
@@ -0,0 +1,75 @@
+#include "telemetry.h"
+
+namespace reven {
+namespace util {
+
+namespace {
+
+const char* callback_names[Telemetry::CallbackCount] = {
+	"before_execution",
+	"after_execution",
+	"lin_access",
+	"access_log",
+	"dev_phy_access",
+	"interrupt",
+	"exception",
+};
+
+double to_seconds(Telemetry::clock::duration duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+}
+
+bool Telemetry::open(const std::string& filename, double interval_seconds) {
+	output_.open(filename);
+	if (!output_)
+		return false;
+
+	interval_ = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(interval_seconds));
+	begin_time_ = last_time_ = clock::now();
+	enabled_ = true;
+
+	return true;
+}
+
+void Telemetry::report_if_due(std::uint64_t icount) {
+	if (clock::now() - last_time_ >= interval_)
+		report(icount);
+}
+
+void Telemetry::report(std::uint64_t icount) {
+	if (not enabled_)
+		return;
+
+	const auto now = clock::now();
+	const double elapsed = to_seconds(now - last_time_);
+	const double rate_factor = elapsed > 0 ? 1. / elapsed : 0.;
+
+	output_ << "{\"time\":" << to_seconds(now - begin_time_)
+	        << ",\"icount\":" << icount
+	        << ",\"instructions_per_s\":" << static_cast<std::uint64_t>((icount - last_icount_) * rate_factor)
+	        << ",\"sync_points\":" << sync_points
+	        << ",\"sync_points_per_s\":" << static_cast<std::uint64_t>((sync_points - last_sync_points_) * rate_factor)
+	        << ",\"hardware_accesses\":" << hardware_accesses
+	        << ",\"trace_bytes\":" << trace_bytes
+	        << ",\"cache_points\":" << cache_points
+	        << ",\"cache_point_s\":" << to_seconds(cache_point_time)
+	        << ",\"memhist_records\":" << memhist_records
+	        << ",\"callbacks\":{";
+
+	for (int callback = 0; callback < CallbackCount; ++callback) {
+		output_ << (callback == 0 ? "" : ",") << "\"" << callback_names[callback] << "\":{"
+		        << "\"calls\":" << callback_calls_[callback]
+		        << ",\"s\":" << to_seconds(callback_time_[callback]) << "}";
+	}
+
+	output_ << "}}" << std::endl;
+
+	last_time_ = now;
+	last_icount_ = icount;
+	last_sync_points_ = sync_points;
+}
+
+}
+}
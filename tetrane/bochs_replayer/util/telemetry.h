@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+namespace reven {
+namespace util {
+
+// Counters of the replay, periodically written as JSON lines when enabled.
+// The counters are always updated; only the timing of the instrumentation callbacks is skipped when disabled.
+class Telemetry {
+public:
+	using clock = std::chrono::steady_clock;
+
+	enum Callback {
+		CallbackBeforeExecution,
+		CallbackAfterExecution,
+		CallbackLinearAccess,
+		CallbackAccessLog,
+		CallbackDevicePhysicalAccess,
+		CallbackInterrupt,
+		CallbackException,
+		CallbackCount
+	};
+
+	bool open(const std::string& filename, double interval_seconds);
+	bool enabled() const { return enabled_; }
+
+	// Called on each trace entered, only look at the clock from time to time
+	void tick(std::uint64_t icount) {
+		if (enabled_ and (++ticks_ & 0xffff) == 0)
+			report_if_due(icount);
+	}
+
+	void report(std::uint64_t icount);
+
+	// Not a RAII timer: the callbacks can longjmp out
+	clock::time_point start_timer() const { return enabled_ ? clock::now() : clock::time_point(); }
+	void stop_timer(Callback callback, clock::time_point start) {
+		if (enabled_) {
+			callback_time_[callback] += clock::now() - start;
+			++callback_calls_[callback];
+		}
+	}
+
+	std::uint64_t sync_points{0};
+	std::uint64_t hardware_accesses{0};
+	std::uint64_t trace_bytes{0};
+	std::uint64_t cache_points{0};
+	clock::duration cache_point_time{0};
+	std::uint64_t memhist_records{0};
+
+private:
+	void report_if_due(std::uint64_t icount);
+
+	bool enabled_{false};
+	std::ofstream output_;
+	clock::duration interval_{0};
+
+	std::uint64_t ticks_{0};
+
+	clock::time_point begin_time_;
+	clock::time_point last_time_;
+	std::uint64_t last_icount_{0};
+	std::uint64_t last_sync_points_{0};
+
+	clock::duration callback_time_[CallbackCount]{};
+	std::uint64_t callback_calls_[CallbackCount]{};
+};
+
+extern Telemetry telemetry;
+
+}
+}